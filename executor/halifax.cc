@@ -30,20 +30,34 @@ class Halifax : public InstructionCache, public StaticReceiver<Halifax>
 public:
   bool  receive(CpuMessage &msg)
   {
+    if (msg.type == CpuMessage::TYPE_CHECK_IRQ) events_checked();
     if (msg.type != CpuMessage::TYPE_SINGLE_STEP) return false;
     step(msg);
     return true;
   }
 
-  Halifax(VCpu *vcpu) : InstructionCache(vcpu) {
-    vcpu->executor.add(this,  receive_static);
+  /**
+   * Snoop the events of our VCPU to stop a basic block early.
+   */
+  bool  receive(CpuEvent &msg)
+  {
+    if (msg.value & ~VCpu::DEASS_INTR) event_pending();
+    return false;
+  }
+
+  Halifax(VCpu *vcpu, unsigned block_size, bool exclusive) : InstructionCache(vcpu, block_size, exclusive) {
+    vcpu->executor.add(this,  receive_static<CpuMessage>);
+    vcpu->bus_event.add(this, receive_static<CpuEvent>);
   }
   void *operator new(size_t size)  { return new /*(__alignof__(Halifax))*/ char[size]; }
 };
 
 PARAM_HANDLER(halifax,
-	      "halifax - create a halifax that emulatates instructions.")
+	      "halifax:[block][,exclusive] - create a halifax that emulatates instructions.",
+	      "block - the maximum number of instructions of a basic block that are executed in a single step. (Default 1)",
+	      "exclusive - the guest never runs natively, thus halifax sees all its writes and paging changes.",
+	      "            Cached instructions are validated by page write generations and the TLB is kept between steps. (Default 0)")
 {
   if (!mb.last_vcpu) Logging::panic("no VCPU for this Halifax");
-  new Halifax(mb.last_vcpu);
+  new Halifax(mb.last_vcpu, (argv[0] == ~0UL || !argv[0]) ? 1 : argv[0], argv[1] != ~0UL && argv[1]);
 }
@@ -109,6 +109,10 @@ struct InstructionCacheEntry
   void     *src;
   void     *dst;
   unsigned immediate;
+  // the write generation of the code page or 0 if not tracked
+  unsigned *gen;
+  unsigned gen_value;
+  unsigned mapping_gen;
 };
 
 
@@ -165,12 +169,20 @@ class InstructionCache : public MemTlb
   unsigned _oeip;
   unsigned _oesp;
   unsigned _ointr_state;
+  // basic-block execution
+  unsigned _block_size;
+  bool     _block_end;
+  volatile bool _event_pending;
+  // the guest does not run natively, thus we see all its modifications
+  bool     _exclusive;
   mword _dr6;
   mword _dr[4];
   unsigned _fpustate [512/sizeof(unsigned)] __attribute__((aligned(16)));
 
   int send_message(CpuMessage::Type type)
   {
+    // the VCPU has to see the state after this instruction
+    _block_end = true;
     CpuMessage msg(type, _cpu, _mtr_in);
     _vcpu->executor.send(msg, true);
     return _fault;
@@ -196,7 +208,17 @@ class InstructionCache : public MemTlb
     if ((~limit && limit < (virt + len - 1)) || ((entry->inst_len + len) > InstructionCacheEntry::MAX_INSTLEN)) GP0;
     virt += READ(cs).base;
 
-    read_code(virt, len, entry->data + entry->inst_len);
+    unsigned *gen = 0;
+    unsigned gen_value = 0;
+    read_code(virt, len, entry->data + entry->inst_len, gen, gen_value);
+    if (!entry->inst_len) {
+      entry->gen = gen;
+      entry->gen_value = gen_value;
+      entry->mapping_gen = _mapping_gen;
+    }
+    // an instruction crossing pages is always revalidated
+    else if (gen != entry->gen)
+      entry->gen = 0;
     entry->inst_len += len;
     return _fault;
   }
@@ -209,17 +231,30 @@ class InstructionCache : public MemTlb
   bool find_entry(unsigned &index)
   {
     unsigned cs_ar = READ(cs).ar;
+    unsigned limit = READ(cs).limit;
     unsigned linear = _cpu->eip + READ(cs).base;
     for (unsigned i = slot(linear); i < slot(linear) + ASSOZ; i++)
-      if (linear == _tags[i] &&  _values[i].inst_len)
+      if (linear == _tags[i] &&  _values[i].inst_len && cs_ar == _values[i].cs_ar)
 	{
+	  InstructionCacheEntry *entry = _values + i;
+
+	  // neither code nor mapping modified since we have fetched it?
+	  if (_exclusive && entry->gen && __atomic_load_n(entry->gen, __ATOMIC_ACQUIRE) == entry->gen_value && entry->mapping_gen == _mapping_gen
+	      && (!~limit || limit >= _cpu->eip + entry->inst_len - 1)) {
+	    index = i;
+	    return true;
+	  }
+
 	  InstructionCacheEntry tmp;
 	  tmp.inst_len = 0;
 	  // revalidate entries
-	  if (fetch_code(&tmp, _values[i].inst_len)) return false;
+	  if (fetch_code(&tmp, entry->inst_len)) return false;
 
-	  // either code modified or two entries with different bases?
-	  if (memcmp(tmp.data, _values[i].data, _values[i].inst_len) || cs_ar != _values[i].cs_ar)  continue;
+	  // code modified?
+	  if (memcmp(tmp.data, entry->data, entry->inst_len))  continue;
+	  entry->gen = tmp.gen;
+	  entry->gen_value = tmp.gen_value;
+	  entry->mapping_gen = tmp.mapping_gen;
 	  index = i;
 	  //COUNTER_INC("I$ ok");
 	  return true;
@@ -560,6 +595,22 @@ public:
     return true;
   }
 
+  /**
+   * Can the next instruction be executed in the same step?  We stop
+   * a basic block at control transfers, at instructions that talk to
+   * the VCPU (I/O, HLT, CPUID...), at CR writes and interrupt
+   * shadows and whenever an event for the VCPU is pending.
+   */
+  bool continue_block(unsigned count, unsigned old_mtr_out)
+  {
+    return count < _block_size
+      && !_fault && !_block_end && !_event_pending
+      && _entry && _cpu->eip == _oeip + _entry->inst_len
+      && !(_cpu->intr_state & 3)
+      && !(_cpu->efl & EFL_TF)
+      && !(_mtr_out & ~old_mtr_out & MTD_CR);
+  }
+
 public:
 
   void step(CpuMessage &msg) {
@@ -567,18 +618,37 @@ public:
     _mtr_in = msg.mtr_in;
     _mtr_out =  msg.mtr_out;
     _fault = 0;
-    if (!init()) {
-      _entry = 0;
-      _oeip = _cpu->eip;
-      _oesp = _cpu->esp;
-      _ointr_state = _cpu->intr_state;
-      // remove sti+movss blocking
-      _cpu->intr_state &= ~3;
-      event_injection() || get_instruction() || execute();
-      if (commit()) invalidate(true);
+    _block_end = false;
+    // only an exclusive guest keeps the TLB between steps
+    if ((_exclusive && !paging_changed()) || !init()) {
+      for (unsigned count = 1;; count++) {
+	unsigned old_mtr_out = _mtr_out;
+	_entry = 0;
+	_oeip = _cpu->eip;
+	_oesp = _cpu->esp;
+	_ointr_state = _cpu->intr_state;
+	// remove sti+movss blocking
+	_cpu->intr_state &= ~3;
+	event_injection() || get_instruction() || execute();
+	if (!commit()) break;
+	invalidate(true);
+	if (!continue_block(count, old_mtr_out)) break;
+      }
     }
+    writes_done();
     msg.mtr_out = _mtr_out;
   }
 
- InstructionCache(VCpu *vcpu) : MemTlb(vcpu->mem, vcpu->memregion), _pos(), _tags(), _values(), _vcpu(vcpu), _entry(), _oeip(), _oesp(), _ointr_state(), _dr6(), _dr(), _fpustate() { }
+  /**
+   * An event for the VCPU arrived, finish the current basic block.
+   */
+  void event_pending() { _event_pending = true; }
+
+  /**
+   * The VCPU looks at its events now, thus only later ones have to
+   * finish a basic block.
+   */
+  void events_checked() { _event_pending = false; }
+
+ InstructionCache(VCpu *vcpu, unsigned block_size, bool exclusive) : MemTlb(vcpu->mem, vcpu->memregion), _pos(), _tags(), _values(), _vcpu(vcpu), _entry(), _oeip(), _oesp(), _ointr_state(), _block_size(block_size), _block_end(), _event_pending(), _exclusive(exclusive), _dr6(), _dr(), _fpustate() { }
 };
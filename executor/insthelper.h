@@ -304,19 +304,21 @@ helper_SDT(SGDT,gd, MTD_GDTR)
   }
 
   template<unsigned operand_size>
-  void __attribute__((regparm(3)))  helper_IN(unsigned port, void *dst)
+  void __attribute__((regparm(3)))  helper_IN(unsigned port, void *dst, unsigned count = 0)
   {
     // XXX check IOPBM
-    CpuMessage msg(true, _cpu, operand_size, port, dst, _mtr_in);
+    _block_end = true;
+    CpuMessage msg(true, _cpu, operand_size, port, dst, _mtr_in, count);
     _vcpu->executor.send(msg, true);
   }
 
   template<unsigned operand_size>
-  void __attribute__((regparm(3)))  helper_OUT(unsigned port, void *dst)
+  void __attribute__((regparm(3)))  helper_OUT(unsigned port, void *dst, unsigned count = 0)
   {
 
     // XXX check IOPBM
-    CpuMessage msg(false, _cpu, operand_size, port, dst, _mtr_in);
+    _block_end = true;
+    CpuMessage msg(false, _cpu, operand_size, port, dst, _mtr_in, count);
     _vcpu->executor.send(msg, true);
   }
 
@@ -348,11 +350,84 @@ int calc_flags(unsigned operand_size, void *src, void *dst) {
 
 #define NCHECK(X)  { if (X) break; }
 #define FEATURE(X,Y) { if (feature & (X)) Y; }
+  /**
+   * Check a segment access like handle_segment() but without
+   * raising a fault.  Expand-down segments are not supported.
+   */
+  bool segment_fits(CpuState::Descriptor *desc, unsigned virt, unsigned length, bool write)
+  {
+    if ((desc->ar & 0xc) == 4 || ~desc->ar & 0x80) return false;
+    if (write ? (desc->ar & 0xa) != 0x2 : (desc->ar & 0xa) == 0x8) return false;
+    return virt + length - 1 >= virt && virt + length - 1 <= desc->limit;
+  }
+
+  /**
+   * Do a run of a rep movs/stos/ins/outs at once, as long as source
+   * and destination stay within a page of RAM.  Returns false if the
+   * next element has to be done one by one.
+   */
+  template<unsigned feature, unsigned operand_size>
+  bool string_bulk()
+  {
+    if (_cpu->efl & 0x400) return false;
+
+    bool     addr16 = _entry->address_size == 1;
+    unsigned count  = addr16 ? _cpu->cx : _cpu->ecx;
+    unsigned edi    = addr16 ? _cpu->di : _cpu->edi;
+    unsigned esi    = addr16 ? _cpu->si : _cpu->esi;
+    CpuState::Descriptor *dseg = &_cpu->es;
+    CpuState::Descriptor *sseg = (&_cpu->es) + ((_entry->prefixes >> 8) & 0xf);
+    unsigned dlin   = dseg->base + edi;
+    unsigned slin   = sseg->base + esi;
+
+    // Stop at the end of a page or at an address wrap.
+    unsigned n = count;
+    FEATURE(SH_SAVE_EDI, if (((0x1000 - (dlin & 0xfff)) >> operand_size) < n) n = (0x1000 - (dlin & 0xfff)) >> operand_size);
+    FEATURE(SH_SAVE_EDI, if (addr16 && ((0x10000 - edi) >> operand_size) < n) n = (0x10000 - edi) >> operand_size);
+    FEATURE(SH_LOAD_ESI, if (((0x1000 - (slin & 0xfff)) >> operand_size) < n) n = (0x1000 - (slin & 0xfff)) >> operand_size);
+    FEATURE(SH_LOAD_ESI, if (addr16 && ((0x10000 - esi) >> operand_size) < n) n = (0x10000 - esi) >> operand_size);
+    if (n < 2) return false;
+
+    unsigned len = n << operand_size;
+    FEATURE(SH_SAVE_EDI, if (!segment_fits(dseg, edi, len, true)) return false);
+    FEATURE(SH_LOAD_ESI, if (!segment_fits(sseg, esi, len, false)) return false);
+
+    char *src = 0;
+    char *dst = 0;
+    FEATURE(SH_LOAD_ESI, if (ram_virtual(slin, len, user_access(TYPE_R), src) || !src) return false);
+    FEATURE(SH_SAVE_EDI, if (ram_virtual(dlin, len, user_access(TYPE_W), dst) || !dst) return false);
+
+    if (feature & SH_DOOP_IN)
+      helper_IN<operand_size>(_cpu->dx, dst, n);
+    else if (feature & SH_DOOP_OUT)
+      helper_OUT<operand_size>(_cpu->dx, src, n);
+    else if (feature & SH_LOAD_ESI) {
+      // An overlapping forward copy repeats the source pattern.
+      if (dst > src && dst < src + len) return false;
+      memmove(dst, src, len);
+    } else if (operand_size == 0)
+      memset(dst, _cpu->al, len);
+    else
+      for (unsigned i = 0; i < len; i += 1 << operand_size)
+	memcpy(dst + i, &_cpu->eax, 1 << operand_size);
+
+    if (addr16) _cpu->cx -= n; else _cpu->ecx -= n;
+    FEATURE(SH_SAVE_EDI, if (addr16) _cpu->di += len; else _cpu->edi += len);
+    FEATURE(SH_LOAD_ESI, if (addr16) _cpu->si += len; else _cpu->esi += len);
+    return true;
+  }
+
   template<unsigned feature, unsigned operand_size>
   int __attribute__((regparm(3)))  string_helper()
   {
     while (_entry->address_size == 1 && _cpu->cx || _entry->address_size == 2 && _cpu->ecx || !(_entry->prefixes & 0xff))
       {
+	// rep movs, stos, ins and outs are done in page-sized runs
+	if (!(feature & (SH_LOAD_EDI | SH_SAVE_EAX)) && (_entry->prefixes & 0xff)) {
+	  if (string_bulk<feature, operand_size>()) continue;
+	  if (_fault) break;
+	}
+
 	void *src = &_cpu->eax;
 	void *dst = &_cpu->eax;
 
@@ -407,21 +482,22 @@ int helper_MOV__EDX__CR0()
   mword *tmp_src = get_reg32(_entry->data[_entry->offset_opcode] & 0x7);
   mword *tmp_dst;
   mword tmp = *tmp_src;
+  bool flush;
   // XXX missing invalid transition checks
   // XXX cr0 has no reserved bit checking
   switch ((_entry->data[_entry->offset_opcode] >> 3) & 0x7)
     {
-    case 0: if (tmp & 0x1ffaffc0U) GP0;  tmp_dst = &_cpu->cr0; tmp |= 0x10; break;
-    case 2: tmp_dst = &_cpu->cr2; break;
-    case 3: tmp_dst = &_cpu->cr3; break;
-    case 4: if (tmp & 0xffff9800U) GP0;  tmp_dst = &_cpu->cr4; break;
+    case 0: if (tmp & 0x1ffaffc0U) GP0;  tmp_dst = &_cpu->cr0; tmp |= 0x10; flush = (*tmp_dst ^ tmp) & 0x80010000; break;
+    case 2: tmp_dst = &_cpu->cr2; flush = false; break;
+    case 3: tmp_dst = &_cpu->cr3; flush = true; break;
+    case 4: if (tmp & 0xffff9800U) GP0;  tmp_dst = &_cpu->cr4; flush = (*tmp_dst ^ tmp) & 0xb0; break;
     default: UD0;
     }
   *tmp_dst = tmp;
   _mtr_out |= MTD_CR;
 
-  // XXX flush only if paging-bits change
-  // update TLB
+  // update TLB only if paging-bits change
+  if (!flush) return _fault;
   return init();
 }
 
@@ -884,7 +960,13 @@ int idt_traversal(unsigned event, unsigned error_code)
 
 
 int helper_INT(unsigned char vector) { return idt_traversal(0x80000600 | vector, 0); }
-int helper_INVLPG() { return _fault; }
+int helper_INVLPG()
+{
+  unsigned virt = modrm2virt();
+  if (_entry->address_size == 1) virt &= 0xffff;
+  tlb_flush_page(virt + (&_cpu->es + ((_entry->prefixes >> 8) & 0x0f))->base);
+  return _fault;
+}
 int helper_FWAIT()                              { return _fault; }
 int helper_MOV__DB0__EDX()
 {
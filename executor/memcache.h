@@ -59,7 +59,9 @@ private:
     // Number of buffers, we need two for movs, push and similar instructions...
     BUFFERS = 6,
     // The maximum size of a buffer, the minmum is 16+dword (cmpxchg16b+instruction-reread).
-    BUFFER_SIZE = 16 + 4
+    BUFFER_SIZE = 16 + 4,
+    // Pages written by an instruction before their generations are incremented.
+    WRITTEN = 16
   };
 
   // the hash function for the cache
@@ -89,6 +91,8 @@ public:
     size_t _len;
     // a pointer in a single linked list to an older entry in the set or ~0u at the end
     unsigned _older;
+    // the write generation of the first page or 0 if the page is not tracked
+    unsigned *_gen;
     bool is_valid(uintptr_t phys1, uintptr_t phys2, size_t len)
     {
       if (!_ptr) return false;
@@ -118,6 +122,24 @@ private:
   unsigned _oldest_write;
   unsigned _newest_write;
 
+  // the write generations of the pages that are written through
+  // pointers from get() and ram(), see writes_done()
+  unsigned *_written[WRITTEN];
+  unsigned  _written_count;
+
+
+  /**
+   * Remember a page that is written.  Only string instructions write
+   * more pages and they have finished the earlier elements.
+   */
+  void track_write(unsigned *gen)
+  {
+    for (unsigned i=0; i < _written_count; i++)
+      if (_written[i] == gen) return;
+    if (_written_count == WRITTEN) writes_done();
+    _written[_written_count++] = gen;
+  }
+
 
   void buffer_io(bool read, unsigned index) {
     assert(!(_buffers[index]._len & 3));
@@ -183,12 +205,10 @@ private:
   assert(~entry);							\
 
 
-public:
-
   /**
-   * Get an entry from the cache or fetch one from memory.
+   * Find an entry in the cache or fetch one from memory.
    */
-  CacheEntry *get(uintptr_t phys1, uintptr_t phys2, size_t len, Type type)
+  CacheEntry *find(uintptr_t phys1, uintptr_t phys2, size_t len, Type type)
   {
     assert(!(phys1 & 3));
     assert(!(len & 3));
@@ -220,6 +240,7 @@ public:
 	res->_len = len;
 	res->_phys1 = phys1;
 	res->_phys2 = phys2;
+	res->_gen   = msg1.gen ? msg1.gen + ((phys1 >> 12) - msg1.start_page) : 0;
 	return_move_to_front(_sets[s]._values, _sets[s]._newest);
       }
     }
@@ -254,6 +275,7 @@ public:
       _buffers[entry]._len   = len;
       _buffers[entry]._phys1 = phys1;
       _buffers[entry]._phys2 = phys2;
+      _buffers[entry]._gen   = 0;
 
       // do we have to read the data into the cache?
       if (type & TYPE_R) buffer_io(true, entry);
@@ -262,12 +284,60 @@ public:
     }
   }
 
+public:
+
+  /**
+   * Get an entry from the cache or fetch one from memory.
+   */
+  CacheEntry *get(uintptr_t phys1, uintptr_t phys2, size_t len, Type type)
+  {
+    CacheEntry *res = find(phys1, phys2, len, type);
+
+    // writing to RAM invalidates the code on these pages
+    if (type & TYPE_W && res->_gen) {
+      track_write(res->_gen);
+      if (phys2 != ~0xffful) track_write(res->_gen + 1);
+    }
+    return res;
+  }
+
+
+  /**
+   * Get a direct pointer to len bytes of RAM or 0 if the range is not
+   * in a single memory region. Writing invalidates the code on these
+   * pages, thus the range may only cross a page, if it is not written.
+   */
+  char *ram(uintptr_t phys, size_t len, Type type)
+  {
+    MessageMemRegion msg(phys >> 12);
+    if (!_memregion.send(msg, true) || !msg.ptr || ((phys + len) > ((msg.start_page + msg.count) << 12))) return 0;
+    if (type & TYPE_W && msg.gen && len) {
+      assert(!((phys ^ (phys + len - 1)) & ~0xffful));
+      track_write(msg.gen + ((phys >> 12) - msg.start_page));
+    }
+    return msg.ptr + (phys - (msg.start_page << 12));
+  }
+
+
+  /**
+   * The writes through the pointers from get() and ram() are done,
+   * thus invalidate the code on these pages.  Incrementing the
+   * generations only after the stores ensures that other CPUs do not
+   * cache old code under a new generation.
+   */
+  void writes_done()
+  {
+    for (unsigned i=0; i < _written_count; i++) Cpu::atomic_xadd(_written[i], 1);
+    _written_count = 0;
+  }
+
 
   /**
    * Invalidate the cache, thus writeback the buffers.
    */
   void invalidate(bool writeback)
     {
+      writes_done();
       if (writeback)
 	while (~_oldest_write) invalidate_dirty();
       else
@@ -276,7 +346,7 @@ public:
     }
 
 
-  MemCache(DBus<MessageMem> &mem, DBus<MessageMemRegion> &memregion) : _mem(mem), _memregion(memregion), _fault(), _error_code(), _debug_fault_line(), _mtr_in(), _mtr_read(), _mtr_out(), debug(false), _sets()
+  MemCache(DBus<MessageMem> &mem, DBus<MessageMemRegion> &memregion) : _mem(mem), _memregion(memregion), _fault(), _error_code(), _debug_fault_line(), _mtr_in(), _mtr_read(), _mtr_out(), debug(false), _sets(), _written_count()
   {
     assert(ASSOZ   >= 2);
     assert(BUFFERS >= 2);
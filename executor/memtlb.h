@@ -27,10 +27,33 @@ class MemTlb : public MemCache
 {
 protected:
   CpuState *_cpu;
+  // incremented whenever cached translations might be stale
+  unsigned _mapping_gen;
 
 private:
+  enum {
+    TLB_SIZE = 256
+  };
+
+  /**
+   * A direct mapped TLB.  The access rights are the ones of the page
+   * walk, so a more privileged access or a write to a clean page
+   * misses and walks again.
+   */
+  struct TlbEntry {
+    uintptr_t virt;
+    uintptr_t phys;
+    unsigned  rights;
+    unsigned  gen;
+  } _tlb[TLB_SIZE];
+  // only entries of this generation are valid
+  unsigned _tlb_gen;
+  // do we have large pages in the TLB?
+  bool _tlb_large;
+
   // pdpt cache for 32-bit PAE
   unsigned long long _pdpt[4];
+  mword _cr3;
   unsigned long _msr_efer;
   unsigned _paging_mode;
 
@@ -112,16 +135,32 @@ private:
     else
       phys = pte >> size;
     phys = (phys << size) | (virt & ((1 << size) - 1));
+
+    TlbEntry *tlb = _tlb + (virt >> 12) % TLB_SIZE;
+    tlb->virt   = virt & ~0xffful;
+    tlb->phys   = phys & ~0xffful;
+    tlb->rights = rights;
+    tlb->gen    = _tlb_gen;
+    _tlb_large |= is_sp;
     return _fault;
   }
 
   int virt_to_phys(uintptr_t virt, Type type, uintptr_t &phys) {
 
-    if (tlb_fill_func) return tlb_fill_func(this, virt, type, phys);
+    if (tlb_fill_func) {
+      TlbEntry *tlb = _tlb + (virt >> 12) % TLB_SIZE;
+      if (tlb->virt == (virt & ~0xffful) && tlb->gen == _tlb_gen && (tlb->rights & type) == type) {
+	phys = tlb->phys | (virt & 0xfff);
+	return _fault;
+      }
+      return tlb_fill_func(this, virt, type, phys);
+    }
     phys = virt;
     return _fault;
   }
 
+  unsigned paging_mode() { return (READ(cr0) & 0x80010000) | READ(cr4) & 0x30 | _msr_efer & 0xc00; }
+
   /**
    * Find a CacheEntry to a virtual memory access.
    */
@@ -144,12 +183,46 @@ protected:
   }
 
 
+  /**
+   * Flush the whole TLB.
+   */
+  void tlb_flush() {
+    _mapping_gen++;
+    _tlb_large = false;
+    if (++_tlb_gen) return;
+
+    // the generation wrapped, thus really invalidate the entries
+    for (unsigned i = 0; i < TLB_SIZE; i++) _tlb[i].virt = ~0ul;
+  }
+
+
+  /**
+   * Flush the translation of a single page.
+   */
+  void tlb_flush_page(uintptr_t virt) {
+    // we do not know which entries belong to a large page
+    if (_tlb_large) return tlb_flush();
+    _mapping_gen++;
+    _tlb[(virt >> 12) % TLB_SIZE].virt = ~0ul;
+  }
+
+
+  /**
+   * Did the paging state change behind our back?
+   */
+  bool paging_changed() { return paging_mode() != _paging_mode || READ(cr3) != _cr3; }
+
+
+  /**
+   * Recompute the paging mode from the CPU state and flush the TLB.
+   */
   int init() {
 
-    _paging_mode = (READ(cr0) & 0x80010000) | READ(cr4) & 0x30 | _msr_efer & 0xc00;
+    unsigned mode = paging_mode();
+    tlb_flush();
 
     // fetch pdpts in leagacy PAE mode
-    if ((_paging_mode & 0x80000420) == 0x80000020)
+    if ((mode & 0x80000420) == 0x80000020)
       {
 	unsigned long long values[4];
 	for (unsigned i=0; i < 4; i++)
@@ -159,6 +232,8 @@ protected:
 	  }
 	memcpy(_pdpt, values, sizeof(_pdpt));
       }
+    _paging_mode = mode;
+    _cr3 = READ(cr3);
 
     // set paging mode
     tlb_fill_func = 0;
@@ -179,13 +254,19 @@ protected:
 
   /**
    * Read the len instruction-bytes at the given address into a buffer.
+   *
+   * Returns the write generation of the page in gen and its value
+   * before the read in gen_value.  The gen is 0 if the code is not
+   * tracked or crosses a page boundary.
    */
-  int read_code(uintptr_t virt, size_t len, void *buffer)
+  int read_code(uintptr_t virt, size_t len, void *buffer, unsigned *&gen, unsigned &gen_value)
   {
     assert(len < 16);
     CacheEntry *entry = find_virtual(virt & ~3, (len + (virt & 3) + 3) & ~3ul, user_access(Type(TYPE_X | TYPE_R)));
     if (entry) {
       assert(len <= entry->_len);
+      gen = entry->_phys2 == ~0xffful ? entry->_gen : 0;
+      if (gen) gen_value = __atomic_load_n(gen, __ATOMIC_ACQUIRE);
       memcpy(buffer, entry->_ptr + (virt & 3), len);
     } else
       // fix CR2 value as we rounded down
@@ -195,6 +276,20 @@ protected:
   }
 
 
+  /**
+   * Get a direct pointer to len bytes of RAM at a virtual address.
+   * The pointer is 0, if the range crosses a page or is not RAM.
+   */
+  int ram_virtual(uintptr_t virt, size_t len, Type type, char *&ptr)
+  {
+    uintptr_t phys;
+    ptr = 0;
+    if ((virt ^ (virt + len - 1)) & ~0xffful) return _fault;
+    if (!virt_to_phys(virt, type, phys)) ptr = ram(phys, len, type);
+    return _fault;
+  }
+
+
   int prepare_virtual(uintptr_t virt, size_t len, Type type, void *&ptr)
   {
     bool round = (virt | len) & 3;
@@ -207,5 +302,8 @@ protected:
   }
 
 
-  MemTlb(DBus<MessageMem> &mem, DBus<MessageMemRegion> &memregion) : MemCache(mem, memregion), _cpu(), _pdpt(), _msr_efer(), _paging_mode(), tlb_fill_func() {}
+  MemTlb(DBus<MessageMem> &mem, DBus<MessageMemRegion> &memregion) : MemCache(mem, memregion), _cpu(), _mapping_gen(), _tlb(), _tlb_gen(), _tlb_large(), _pdpt(), _cr3(), _msr_efer(), _paging_mode(), tlb_fill_func()
+  {
+    for (unsigned i = 0; i < TLB_SIZE; i++) _tlb[i].virt = ~0ul;
+  }
 };
@@ -418,6 +418,12 @@ public:
     case MessageNetwork::QUERY_MAC:
       nmsg.mac = Endian::hton64(_mac.raw) >> 16;
       return true;
+    case MessageNetwork::PACKETS:
+      for (unsigned i = 0; i < nmsg.packetcount; i++) {
+        MessageNetwork m = nmsg.packet(i);
+        receive(m);
+      }
+      return true;
     case MessageNetwork::PACKET:
         // Protect against our own packets. WTF?
         if ((nmsg.buffer >= static_cast<void *>(_rx_buf[0])) &&
@@ -426,7 +432,7 @@ public:
 
         {
           unsigned tail = _hwreg[TDT];
-          memcpy(_tx_buf[tail], nmsg.buffer, nmsg.len);
+          nmsg.copy(_tx_buf[tail], nmsg.len);
 
           // If the dma descriptor is not zero, it is still in use.
           if ((_tx_ring[tail].lo | _tx_ring[tail].hi) != 0)  {
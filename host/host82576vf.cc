@@ -182,6 +182,12 @@ public:
     case MessageNetwork::QUERY_MAC:
       nmsg.mac = Endian::hton64(_mac.raw) >> 16;
       return true;
+    case MessageNetwork::PACKETS:
+      for (unsigned i = 0; i < nmsg.packetcount; i++) {
+        MessageNetwork m = nmsg.packet(i);
+        receive(m);
+      }
+      return true;
     case MessageNetwork::PACKET:
       {
         // Protect against our own packets. WTF?
@@ -191,7 +197,7 @@ public:
 
         // XXX Lock?
         unsigned tail = _hwreg[TDT0];
-        memcpy(_tx_buf[tail], nmsg.buffer, nmsg.len);
+        nmsg.copy(_tx_buf[tail], nmsg.len);
 
         // If the dma descriptor is not zero, it is still in use.
         if ((_tx_ring[tail].lo | _tx_ring[tail].hi) != 0) return false;
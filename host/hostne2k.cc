@@ -137,7 +137,19 @@ public:
     switch (msg.type) {
     case MessageNetwork::PACKET:
       if (msg.buffer >= _receive_buffer && msg.buffer < _receive_buffer + BUFFER_SIZE) return false;
-      return send_packet(msg.buffer, msg.len);
+      if (msg.buffer) return send_packet(msg.buffer, msg.len);
+      {
+        // send_packet() needs a contiguous buffer
+        unsigned char buf[(PG_START - PG_TX) * PAGE_SIZE];
+        if (msg.len > sizeof(buf)) return false;
+        return send_packet(buf, msg.copy(buf, sizeof(buf)));
+      }
+    case MessageNetwork::PACKETS:
+      for (unsigned i = 0; i < msg.packetcount; i++) {
+        MessageNetwork m = msg.packet(i);
+        receive(m);
+      }
+      return true;
     case MessageNetwork::QUERY_MAC:
       msg.mac = Endian::hton64(_mac.raw) >> 16;
       return true;
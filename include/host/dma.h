@@ -19,6 +19,7 @@
 
 #include "service/string.h"
 #include "service/helper.h"
+#include "nul/message.h"
 
 struct DmaDescriptor
 {
@@ -63,6 +64,68 @@ struct DmaDescriptor
     return len > 0;
   }
 
+
+  /**
+   * Map DMA buffers to guest RAM.  Calls fn(ptr, len) for every piece
+   * of host memory, where pieces that are contiguous in the host are
+   * merged.  Every descriptor has to be completely backed by memory
+   * regions with a direct mapping.
+   *
+   * Returns the number of mapped descriptors, thus dmacount on success.
+   */
+  template <typename F>
+  static size_t map(DBus<MessageMemRegion> &bus_memregion, size_t dmacount, DmaDescriptor *dma, F fn)
+  {
+    char  *ptr = 0;
+    size_t len = 0;
+    size_t i;
+    for (i=0; i < dmacount; i++) {
+      uintptr_t address = dma[i].byteoffset;
+      size_t    count   = dma[i].bytecount;
+      while (count) {
+	MessageMemRegion msg(address >> 12);
+	if (!bus_memregion.send(msg, true) || !msg.ptr) return i;
+
+	uintptr_t end = (msg.start_page + msg.count) << 12;
+	size_t sublen = end - address < count ? end - address : count;
+	char *p = msg.ptr + (address - (msg.start_page << 12));
+	if (len && ptr + len == p)
+	  len += sublen;
+	else {
+	  if (len) fn(ptr, len);
+	  ptr = p;
+	  len = sublen;
+	}
+	address += sublen;
+	count   -= sublen;
+      }
+    }
+    if (len) fn(ptr, len);
+    return i;
+  }
+
+
+  /**
+   * Tell the memory regions that a device wrote to the DMA buffers,
+   * which invalidates cached instructions there.
+   */
+  static void written(DBus<MessageMemRegion> &bus_memregion, size_t dmacount, DmaDescriptor *dma)
+  {
+    for (size_t i=0; i < dmacount; i++) {
+      uintptr_t address = dma[i].byteoffset;
+      size_t    count   = dma[i].bytecount;
+      while (count) {
+	MessageMemRegion msg(address >> 12);
+	if (!bus_memregion.send(msg, true)) break;
+
+	uintptr_t end = (msg.start_page + msg.count) << 12;
+	size_t sublen = end - address < count ? end - address : count;
+	msg.written(address, sublen);
+	address += sublen;
+	count   -= sublen;
+      }
+    }
+  }
 };
 
 
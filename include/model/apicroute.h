@@ -0,0 +1,62 @@
+/** @file
+ * Decoded interrupt messages.
+ *
+ * This file is part of Vancouver.
+ *
+ * Vancouver is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * Vancouver is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License version 2 for more details.
+ */
+
+#pragma once
+
+/**
+ * The route of an interrupt message from an MSI address and data
+ * pair to the local APICs.
+ *
+ * Interrupt sources decode it once when the guest programs them and
+ * deliver it later with a single message to the addressed LAPICs.
+ */
+struct ApicRoute
+{
+  unsigned icr;
+  unsigned dst;
+  bool     lowest;
+  bool     valid;
+
+  ApicRoute() : icr(0), dst(0), lowest(false), valid(false) {}
+
+  ApicRoute(unsigned long long address, unsigned data)
+    : icr(data & 0xc7ff), dst((address >> 12) & 0xff | (address << 4) & 0xff00), lowest(false), valid(true)
+  {
+    unsigned event = 1 << ((icr >> 8) & 7);
+
+    // do not forward RRD and SIPI
+    if (event & (VCpu::EVENT_RRD | VCpu::EVENT_SIPI)) { valid = false; return; }
+
+    // set logical destination mode
+    if (address & MessageMem::MSI_DM) icr |= MessageApic::ICR_DM;
+
+    // lowest prio mode? we send them round-robin as EVENT_FIXED
+    if (address & MessageMem::MSI_RH || event & VCpu::EVENT_LOWEST) {
+      lowest = true;
+      icr   &= ~0x700;
+    }
+  }
+
+  /**
+   * Deliver the interrupt. A level-triggered I/O APIC pin sets
+   * the assert bit.
+   */
+  bool send(ApicDirectory &apics, unsigned &lowest_rr, bool level = false) const
+  {
+    if (!valid) return false;
+    MessageApic msg(level ? icr | MessageApic::ICR_ASSERT : icr, dst, 0);
+    return lowest ? apics.send_rr(msg, lowest_rr) : apics.send(msg);
+  }
+};
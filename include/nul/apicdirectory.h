@@ -0,0 +1,198 @@
+/** @file
+ * Destination index of the local APICs.
+ *
+ * This file is part of Vancouver.
+ *
+ * Vancouver is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * Vancouver is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License version 2 for more details.
+ */
+
+#pragma once
+#include "service/cpu.h"
+#include "bus.h"
+#include "message.h"
+
+/**
+ * The local APICs of a motherboard indexed by their destination.
+ *
+ * Every LAPIC adds itself and updates its entry when its APIC ID,
+ * logical destination or mode changes.  An interrupt message is then
+ * only offered to the LAPICs that are addressed by its physical ID or
+ * logical cluster instead of to all LAPICs on the bus.  The receivers
+ * still check the destination exactly, thus the index only has to
+ * contain a superset of them.
+ *
+ * The index is updated with atomic operations, thus messages can be
+ * sent without a lock.  If there are more than MAX_APICS LAPICs, the
+ * messages go to the bus instead.
+ */
+class ApicDirectory
+{
+public:
+  typedef bool (*ReceiveFunction)(Device *, MessageApic &);
+
+private:
+  enum {
+    MAX_APICS    = 256,
+    WORDS        = MAX_APICS / 32,
+    // rows of the index
+    ROW_PHYS     = 0,    // by APIC ID
+    ROW_FLAT     = 256,  // by bit in the xAPIC flat model
+    ROW_CLUSTER  = 264,  // by xAPIC cluster
+    ROW_X2APIC   = 280,  // by the lower bits of the x2APIC cluster
+    ROWS         = 536
+  };
+
+  struct Entry
+  {
+    Device         *dev;
+    ReceiveFunction func;
+    bool            enabled;
+    bool            x2apic;
+    bool            flat;
+    unsigned        id;
+    unsigned        ldr;
+  };
+
+  DBus<MessageApic> &_bus;
+  Entry    _entries[MAX_APICS];
+  unsigned _count;
+  bool     _overflow;
+  unsigned _all[WORDS];
+  unsigned _index[ROWS][WORDS];
+
+  void mark_row(unsigned row, unsigned slot, bool value) { Cpu::atomic_set_bit(_index[row], slot, value); }
+
+  /**
+   * Set or clear the rows that address an entry.
+   */
+  void mark(unsigned slot, bool value)
+  {
+    Entry &e = _entries[slot];
+    if (!e.enabled) return;
+
+    Cpu::atomic_set_bit(_all, slot, value);
+    if (e.x2apic) {
+      mark_row(ROW_PHYS + (e.id & 0xff), slot, value);
+      mark_row(ROW_X2APIC + ((e.ldr >> 16) & 0xff), slot, value);
+      return;
+    }
+
+    mark_row(ROW_PHYS + (e.id >> 24), slot, value);
+    if (!e.flat)
+      mark_row(ROW_CLUSTER + (e.ldr >> 28), slot, value);
+    else
+      for (unsigned bits = e.ldr >> 24; bits; bits &= bits - 1)
+	mark_row(ROW_FLAT + Cpu::bsf(bits), slot, value);
+  }
+
+  /**
+   * Collect the LAPICs that may accept a message.  The destination
+   * is interpreted for xAPIC and x2APIC receivers at the same time.
+   */
+  void lookup(MessageApic &msg, unsigned *res)
+  {
+    unsigned dst = msg.dst & 0xff;
+
+    // broadcast
+    if (dst == 0xff) {
+      memcpy(res, _all, sizeof(_all));
+      return;
+    }
+
+    if (~msg.icr & MessageApic::ICR_DM) {
+      memcpy(res, _index[ROW_PHYS + dst], sizeof(_all));
+      return;
+    }
+
+    memcpy(res, _index[ROW_CLUSTER + (dst >> 4)], sizeof(_all));
+    for (unsigned i=0; i < WORDS; i++) res[i] |= _index[ROW_X2APIC + ((msg.dst >> 16) & 0xff)][i];
+    for (; dst; dst &= dst - 1)
+      for (unsigned i=0; i < WORDS; i++) res[i] |= _index[ROW_FLAT + Cpu::bsf(dst)][i];
+  }
+
+public:
+  /**
+   * Add a LAPIC and return its slot.
+   */
+  unsigned add(Device *dev, ReceiveFunction func)
+  {
+    if (_count >= MAX_APICS) {
+      _overflow = true;
+      return ~0u;
+    }
+    Entry &e = _entries[_count];
+    e.dev     = dev;
+    e.func    = func;
+    e.enabled = false;
+    return _count++;
+  }
+
+  /**
+   * Update the destination of a LAPIC.  The ldr is the logical
+   * destination register in the format of the current mode.
+   */
+  void update(unsigned slot, bool enabled, bool x2apic, unsigned id, unsigned ldr, bool flat)
+  {
+    if (slot >= _count) return;
+    Entry &e = _entries[slot];
+    mark(slot, false);
+    e.x2apic  = x2apic;
+    e.id      = id;
+    e.ldr     = ldr;
+    e.flat    = flat;
+    e.enabled = enabled;
+    mark(slot, true);
+  }
+
+  /**
+   * Send a message to all LAPICs it is addressed to.
+   */
+  bool send(MessageApic &msg)
+  {
+    if (_overflow) return _bus.send(msg);
+
+    unsigned targets[WORDS];
+    lookup(msg, targets);
+
+    bool res = false;
+    for (unsigned i=0; i < WORDS; i++)
+      for (unsigned bits = targets[i]; bits; bits &= bits - 1) {
+	Entry &e = _entries[i * 32 + Cpu::bsf(bits)];
+	res |= e.func(e.dev, msg);
+      }
+    return res;
+  }
+
+  /**
+   * Send a message to the first addressed LAPIC after start that
+   * accepts it and return the number of the next one.
+   */
+  bool send_rr(MessageApic &msg, unsigned &start)
+  {
+    if (_overflow) return _bus.send_rr(msg, start);
+
+    unsigned targets[WORDS];
+    lookup(msg, targets);
+
+    for (unsigned i=0; i < _count; i++) {
+      unsigned slot = (i + start) % _count;
+      if (!Cpu::get_bit(targets, slot)) continue;
+
+      Entry &e = _entries[slot];
+      if (e.func(e.dev, msg)) {
+	start = (slot + 1) % _count;
+	return true;
+      }
+    }
+    return false;
+  }
+
+  ApicDirectory(DBus<MessageApic> &bus) : _bus(bus), _count(0), _overflow(false), _all(), _index() {}
+};
@@ -34,8 +34,38 @@ public:
 };
 
 
+/**
+ * A lock that serializes the devices on a bus. The implementation is
+ * provided by the environment, busses without a lock are not
+ * serialized at all.
+ */
+class DBusLock
+{
+public:
+  virtual void lock() = 0;
+  virtual void unlock() = 0;
+};
+
+
+/**
+ * The address of a message that is used by DBus for range-indexed
+ * dispatch.  Messages that carry an address specialize this template.
+ */
+template <class M>
+struct DBusAddress
+{
+  static unsigned long get(M &) { Logging::panic("%s no address for this message", __PRETTY_FUNCTION__); }
+};
+
+
 /**
  * A bus is a way to connect devices.
+ *
+ * Devices that only respond to fixed address ranges can be added
+ * together with these ranges.  A send() only calls them if the
+ * address of the message is within such a range.  All other devices
+ * see every message, for instance to snoop or because their ranges
+ * change at runtime.
  */
 template <class M>
 class DBus
@@ -45,12 +75,52 @@ class DBus
   {
     Device *_dev;
     ReceiveFunction _func;
+    bool _ranged;
+  };
+
+  struct Range
+  {
+    unsigned long _base;
+    unsigned long _last;
+    unsigned _entry;
+  };
+
+  /**
+   * The ranges split the address space into segments that start at
+   * _base and end at the next segment.  Each one references the
+   * entries covering it in descending order.
+   */
+  struct Segment
+  {
+    unsigned long _base;
+    unsigned _first;
+    unsigned _count;
   };
 
   unsigned long _debug_counter;
   unsigned _list_count;
   unsigned _list_size;
   struct Entry *_list;
+  DBusLock *_lock;
+
+  unsigned _range_count;
+  Range *_ranges;
+  unsigned _segment_count;
+  Segment *_segments;
+  unsigned *_segment_entries;
+  unsigned _unranged_count;
+  unsigned *_unranged;
+
+  /**
+   * Hold the bus lock for the lifetime of this object.
+   */
+  class Guard
+  {
+    DBusLock *_lock;
+  public:
+    Guard(DBusLock *lock) : _lock(lock) { if (_lock) _lock->lock(); }
+    ~Guard() { if (_lock) _lock->unlock(); }
+  };
 
   /**
    * To avoid bugs we disallow the copy constuctor.
@@ -65,26 +135,144 @@ class DBus
     _list = n;
     _list_size = new_size;
   };
-public:
 
-  void add(Device *dev, ReceiveFunction func)
+  unsigned add_entry(Device *dev, ReceiveFunction func, bool ranged)
   {
     if (_list_count >= _list_size)
       set_size(_list_size > 0 ? _list_size * 2 : 1);
     _list[_list_count]._dev    = dev;
     _list[_list_count]._func = func;
-    _list_count++;
+    _list[_list_count]._ranged = ranged;
+    return _list_count++;
   }
 
+  /**
+   * Recalculate the segments from the ranges.  This is only done
+   * when devices are added, thus we keep it simple.
+   */
+  void build_index()
+  {
+    delete [] _segments;
+    delete [] _segment_entries;
+    delete [] _unranged;
+
+    // the entries that see all messages
+    _unranged = new unsigned[_list_count];
+    _unranged_count = 0;
+    for (unsigned i = _list_count; i--;)
+      if (!_list[i]._ranged) _unranged[_unranged_count++] = i;
+
+    // sorted segment boundaries
+    unsigned long *bounds = new unsigned long[2 * _range_count];
+    unsigned nbounds = 0;
+    for (unsigned i = 0; i < 2 * _range_count; i++) {
+      Range &r = _ranges[i / 2];
+      if (i & 1 && !~r._last) continue;
+      unsigned long b = (i & 1) ? r._last + 1 : r._base;
+      unsigned j = 0;
+      while (j < nbounds && bounds[j] < b) j++;
+      if (j < nbounds && bounds[j] == b) continue;
+      memmove(bounds + j + 1, bounds + j, (nbounds - j) * sizeof(*bounds));
+      bounds[j] = b;
+      nbounds++;
+    }
+
+    _segments = new Segment[nbounds];
+    _segment_entries = new unsigned[nbounds * _list_count];
+    _segment_count = nbounds;
+    for (unsigned i = 0; i < nbounds; i++) {
+      Segment &s = _segments[i];
+      s._base  = bounds[i];
+      s._first = i * _list_count;
+      s._count = 0;
+      for (unsigned e = _list_count; e--;)
+	for (unsigned r = 0; r < _range_count; r++)
+	  if (_ranges[r]._entry == e && _ranges[r]._base <= s._base && s._base <= _ranges[r]._last) {
+	    _segment_entries[s._first + s._count++] = e;
+	    break;
+	  }
+    }
+    delete [] bounds;
+  }
+
+  /**
+   * Find the entries that have a range covering the given address.
+   */
+  unsigned *lookup(unsigned long address, unsigned &count)
+  {
+    unsigned l = 0, r = _segment_count;
+    while (l < r) {
+      unsigned m = (l + r) / 2;
+      if (_segments[m]._base <= address) l = m + 1; else r = m;
+    }
+    if (!l) { count = 0; return nullptr; }
+    count = _segments[l - 1]._count;
+    return _segment_entries + _segments[l - 1]._first;
+  }
+
+public:
+
+  void add(Device *dev, ReceiveFunction func)
+  {
+    add_entry(dev, func, false);
+    if (_range_count) build_index();
+  }
+
+  /**
+   * Add a device that only receives messages with an address in
+   * [base, base+size).  Adding the same device and function again
+   * extends its ranges.
+   */
+  void add(Device *dev, ReceiveFunction func, unsigned long base, unsigned long size)
+  {
+    unsigned entry = _list_count;
+    for (unsigned i = 0; i < _list_count; i++)
+      if (_list[i]._ranged && _list[i]._dev == dev && _list[i]._func == func) entry = i;
+    if (entry == _list_count) add_entry(dev, func, true);
+
+    Range *n = new Range[_range_count + 1];
+    memcpy(n, _ranges, _range_count * sizeof(*_ranges));
+    delete [] _ranges;
+    _ranges = n;
+    _ranges[_range_count]._base  = base;
+    _ranges[_range_count]._last  = base + size - 1;
+    _ranges[_range_count]._entry = entry;
+    _range_count++;
+    build_index();
+  }
+
+  /**
+   * Serialize all messages on this bus with the given lock. The lock
+   * has to be recursive, as devices send messages from within their
+   * receive functions.
+   */
+  void set_lock(DBusLock *lock) { _lock = lock; }
+
   /**
    * Send message LIFO.
    */
   bool  send(M &msg, bool earlyout = false)
   {
+    Guard guard(_lock);
     _debug_counter++;
     bool res = false;
-    for (unsigned i = _list_count; i-- && !(earlyout && res);)
+    if (!_range_count) {
+      for (unsigned i = _list_count; i-- && !(earlyout && res);)
+	res |= _list[i]._func(_list[i]._dev, msg);
+      return res;
+    }
+
+    // merge the matching ranged entries with the unranged ones
+    unsigned rcount;
+    unsigned *r = lookup(DBusAddress<M>::get(msg), rcount);
+    unsigned *u = _unranged;
+    unsigned ucount = _unranged_count;
+    while ((rcount || ucount) && !(earlyout && res)) {
+      unsigned i;
+      if (!ucount || (rcount && *r > *u)) { i = *r++; rcount--; }
+      else                                { i = *u++; ucount--; }
       res |= _list[i]._func(_list[i]._dev, msg);
+    }
     return res;
   }
 
@@ -93,6 +281,7 @@ public:
    */
   bool  send_fifo(M &msg)
   {
+    Guard guard(_lock);
     _debug_counter++;
     bool res = false;
     for (unsigned i = 0; i < _list_count; i++)
@@ -107,6 +296,7 @@ public:
    */
   bool  send_rr(M &msg, unsigned &start)
   {
+    Guard guard(_lock);
     _debug_counter++;
     for (unsigned i = 0; i < _list_count; i++)
       if (_list[i]._func(_list[(i + start) % _list_count]._dev, msg)) {
@@ -138,5 +328,7 @@ public:
   }
 
   /** Default constructor. */
-  DBus() : _debug_counter(0), _list_count(0), _list_size(0), _list(nullptr) {}
+  DBus() : _debug_counter(0), _list_count(0), _list_size(0), _list(nullptr), _lock(nullptr),
+	   _range_count(0), _ranges(nullptr), _segment_count(0), _segments(nullptr), _segment_entries(nullptr),
+	   _unranged_count(0), _unranged(nullptr) {}
 };
@@ -22,12 +22,19 @@
 
 #include <nul/types.h>
 #include <nul/compiler.h>
+#include <service/cpu.h>
+#include "bus.h"
 
 /****************************************************/
 /* IOIO messages                                    */
 /****************************************************/
 /**
  * An in() from an ioport.
+ *
+ * A non-zero count requests a block transfer of count elements to
+ * ptr as done by rep ins.  A receiver that supports it advances ptr
+ * and decrements count for every element it transferred.  All others
+ * have to ignore such messages.
  */
 struct MessageIOIn
 {
@@ -46,6 +53,8 @@ struct MessageIOIn
   MessageIOIn(Type _type, unsigned short _port, unsigned _count, void *_ptr) : type(_type), port(_port), count(_count), ptr(_ptr) {}
 };
 
+template <> struct DBusAddress<MessageIOIn> { static unsigned long get(MessageIOIn &msg) { return msg.port; } };
+
 struct MessageHwIOIn : public MessageIOIn {
   MessageHwIOIn(Type _type, unsigned short _port) : MessageIOIn(_type, _port) {}
   MessageHwIOIn(Type _type, unsigned short _port, unsigned _count, void *_ptr) : MessageIOIn(_type, _port, _count, _ptr) {}
@@ -53,7 +62,7 @@ struct MessageHwIOIn : public MessageIOIn {
 
 
 /**
- * An out() to an ioport.
+ * An out() to an ioport.  The block form works as for MessageIOIn.
  */
 struct MessageIOOut {
   enum Type {
@@ -71,6 +80,8 @@ struct MessageIOOut {
   MessageIOOut(Type _type, unsigned short _port, unsigned _count, void *_ptr) : type(_type), port(_port), count(_count), ptr(_ptr) {}
 };
 
+template <> struct DBusAddress<MessageIOOut> { static unsigned long get(MessageIOOut &msg) { return msg.port; } };
+
 struct MessageHwIOOut : public MessageIOOut {
   MessageHwIOOut(Type _type, unsigned short _port, unsigned _value) : MessageIOOut(_type, _port, _value) {}
   MessageHwIOOut(Type _type, unsigned short _port, unsigned _count, void *_ptr) : MessageIOOut(_type, _port, _count, _ptr) {}
@@ -97,12 +108,21 @@ struct MessageMem
   MessageMem(bool _read, uintptr_t _phys, unsigned *_ptr) : read(_read), phys(_phys), ptr(_ptr) {}
 };
 
+template <> struct DBusAddress<MessageMem> { static unsigned long get(MessageMem &msg) { return msg.phys; } };
+
 /**
  * Request a region that is directly mapped into our memory.  Used for
  * mapping it to the user and optimizing internal access.
  *
  * Note, that clients can also return an empty region by not setting
  * the ptr.
+ *
+ * RAM regions additionally return a write generation per page, that
+ * is incremented whenever the page is modified.  The instruction
+ * cache uses it to detect modified code.  Whoever writes to the
+ * region directly has to call written() after the write, as the
+ * instruction cache might otherwise fetch the old code under the new
+ * generation.
  */
 struct MessageMemRegion
 {
@@ -110,7 +130,21 @@ struct MessageMemRegion
   uintptr_t start_page;
   unsigned      count;
   char *        ptr;
-  MessageMemRegion(uintptr_t _page) : page(_page), count(0), ptr(0) {}
+  unsigned *    gen;
+  MessageMemRegion(uintptr_t _page) : page(_page), count(0), ptr(0), gen(0) {}
+
+  /**
+   * Account a write to the physical range [phys, phys+len).
+   */
+  void written(uintptr_t phys, size_t len)
+  {
+    if (!gen || !len) return;
+    uintptr_t first = phys >> 12;
+    uintptr_t last  = (phys + len - 1) >> 12;
+    if (first < start_page) first = start_page;
+    if (last >= start_page + count) last = start_page + count - 1;
+    for (uintptr_t p = first; p <= last; p++) Cpu::atomic_xadd(gen + p - start_page, 1);
+  }
 };
 
 
@@ -689,7 +723,8 @@ struct MessageTimer
     } type;
   unsigned  nr;
   timevalue abstime;
-  MessageTimer()              : type(TIMER_NEW) {}
+  VCpu     *vcpu;   // CPU-local timer, whose timeouts go to vcpu->bus_timeout
+  explicit MessageTimer(VCpu *_vcpu = 0) : type(TIMER_NEW), vcpu(_vcpu) {}
   MessageTimer(unsigned  _nr, timevalue _abstime) : type(TIMER_REQUEST_TIMEOUT), nr(_nr), abstime(_abstime) {}
 };
 
@@ -729,22 +764,79 @@ struct MessageNetwork
 {
   enum ops {
     PACKET,
-    QUERY_MAC
+    QUERY_MAC,
+    PACKETS
+  };
+
+  /**
+   * A part of a packet. Fragments are only valid during the send.
+   */
+  struct Fragment
+  {
+    const unsigned char *buffer;
+    size_t len;
+  };
+
+  /**
+   * A fragmented packet in a PACKETS message.
+   */
+  struct Packet
+  {
+    const Fragment *fragments;
+    unsigned fragcount;
+    size_t len;
   };
 
   unsigned type;
 
   union {
     struct {
+      // a contiguous packet or null if the packet is given as fragments
       const unsigned char *buffer;
+      // the length of the whole packet
       size_t len;
+      const Fragment *fragments;
+      unsigned fragcount;
+    };
+    // a batch of packets, e.g. the segments of a TSO packet
+    struct {
+      const Packet *packets;
+      unsigned packetcount;
     };
     unsigned long long mac;
   };
 
   unsigned client;
 
-  MessageNetwork(const unsigned char *buffer, size_t len, unsigned client) : type(PACKET), buffer(buffer), len(len), client(client) {}
+  /**
+   * Copy the packet to a buffer and return the number of bytes copied.
+   */
+  size_t copy(unsigned char *dst, size_t size) const
+  {
+    if (len < size) size = len;
+    if (buffer) {
+      memcpy(dst, buffer, size);
+      return size;
+    }
+    size_t done = 0;
+    for (unsigned i = 0; i < fragcount && done < size; i++) {
+      size_t n = fragments[i].len < size - done ? fragments[i].len : size - done;
+      memcpy(dst + done, fragments[i].buffer, n);
+      done += n;
+    }
+    return done;
+  }
+
+  /**
+   * The i-th packet of a PACKETS message.
+   */
+  MessageNetwork packet(unsigned i) const { return MessageNetwork(packets[i].fragments, packets[i].fragcount, packets[i].len, client); }
+
+  MessageNetwork(const unsigned char *buffer, size_t len, unsigned client) : type(PACKET), buffer(buffer), len(len), fragments(0), fragcount(0), client(client) {}
+  MessageNetwork(const Fragment *fragments, unsigned fragcount, size_t len, unsigned client)
+    : type(PACKET), buffer(0), len(len), fragments(fragments), fragcount(fragcount), client(client) {}
+  MessageNetwork(const Packet *packets, unsigned packetcount, unsigned client)
+    : type(PACKETS), packets(packets), packetcount(packetcount), client(client) {}
   MessageNetwork(unsigned type, unsigned client) : type(type), mac(0), client(client) { }
 };
 
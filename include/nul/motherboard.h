@@ -23,6 +23,7 @@
 #include "service/string.h"
 #include "bus.h"
 #include "message.h"
+#include "apicdirectory.h"
 #include "timer.h"
 #include "templates.h"
 
@@ -44,7 +45,7 @@ class Motherboard
   /**
    * To avoid bugs we disallow the copy constructor.
    */
-  Motherboard(const Motherboard &) { Logging::panic("%s copy constructor called", __func__); }
+  Motherboard(const Motherboard &) : apic_directory(bus_apic) { Logging::panic("%s copy constructor called", __func__); }
 
  public:
   DBus<MessageAcpi>         bus_acpi;
@@ -79,6 +80,8 @@ class Motherboard
   DBus<MessageTimer>        bus_timer;      ///< Request for timers
   DBus<MessageVesa>         bus_vesa;
 
+  ApicDirectory             apic_directory; ///< LAPICs by destination, delivers what goes to bus_apic
+
   VCpu *last_vcpu;
   Clock *clock() { return _clock; }
   Hip   *hip() { return _hip; }
@@ -150,5 +153,5 @@ class Motherboard
       }
   }
 
-  Motherboard(Clock *__clock, Hip *__hip) : _clock(__clock), _hip(__hip), last_vcpu(0)  {}
+  Motherboard(Clock *__clock, Hip *__hip) : _clock(__clock), _hip(__hip), apic_directory(bus_apic), last_vcpu(0)  {}
 };
@@ -76,6 +76,10 @@ class Clock
 
 /**
  * Keeping track of the timeouts.
+ *
+ * The programmed timeouts are kept in a binary min-heap, thus request
+ * and cancel are O(log n).  Free timeout objects are kept in a list.
+ * The list starts with ENTRIES objects and grows on demand.
  */
 template <unsigned ENTRIES, typename DATA>
 class TimeoutList
@@ -83,81 +87,149 @@ class TimeoutList
   class TimeoutEntry
   {
     friend class TimeoutList<ENTRIES, DATA>;
-    TimeoutEntry *_next;
-    TimeoutEntry *_prev;
     timevalue _timeout;
-    DATA * data;
+    DATA *    data;
+    unsigned  _pos;   // heap index + 1 or zero if not programmed
+    unsigned  _next;  // next free entry
     bool      _free;
   };
 
-  TimeoutEntry  _entries[ENTRIES];
+  TimeoutEntry *_entries;
+  unsigned     *_heap;
+  unsigned      _size;
+  unsigned      _count;
+  unsigned      _free_list;
+
+  bool before(unsigned a, unsigned b) { return _entries[_heap[a]]._timeout < _entries[_heap[b]]._timeout; }
+
+  void swap(unsigned a, unsigned b)
+  {
+    unsigned t = _heap[a];
+    _heap[a] = _heap[b];
+    _heap[b] = t;
+    _entries[_heap[a]]._pos = a + 1;
+    _entries[_heap[b]]._pos = b + 1;
+  }
+
+  void sift_up(unsigned i)
+  {
+    for (; i && before(i, (i - 1) / 2); i = (i - 1) / 2)
+      swap(i, (i - 1) / 2);
+  }
+
+  void sift_down(unsigned i)
+  {
+    while (true) {
+      unsigned m = i;
+      if (2*i + 1 < _count && before(2*i + 1, m)) m = 2*i + 1;
+      if (2*i + 2 < _count && before(2*i + 2, m)) m = 2*i + 2;
+      if (m == i) return;
+      swap(i, m);
+      i = m;
+    }
+  }
+
+  /**
+   * Grow the arrays and put the new entries on the free list.
+   */
+  void grow(unsigned new_size)
+  {
+    TimeoutEntry *e = new TimeoutEntry[new_size];
+    unsigned     *h = new unsigned[new_size];
+    if (_entries) {
+      memcpy(e, _entries, _size * sizeof(*_entries));
+      memcpy(h, _heap, _count * sizeof(*_heap));
+      delete [] _entries;
+      delete [] _heap;
+    }
+    _entries = e;
+    _heap    = h;
+
+    // entry zero is never handed out
+    for (unsigned i = new_size - 1; i >= (_size ? _size : 1); i--) {
+      _entries[i]._pos  = 0;
+      _entries[i].data  = 0;
+      _entries[i]._free = true;
+      _entries[i]._next = _free_list;
+      _free_list = i;
+    }
+    _size = new_size;
+  }
+
+  TimeoutList(const TimeoutList &);
 public:
   /**
    * Alloc a new timeout object.
    */
   unsigned alloc(DATA * _data = 0)
   {
-    unsigned i;
-    for (i=1; i < ENTRIES; i++) {
-      if (not _entries[i]._free) continue;
-      _entries[i].data  = _data;
-      _entries[i]._free = false;
-      return i;
-    }
-    Logging::panic("Can't alloc a timer!\n");
-    return 0;
+    if (!_free_list) grow(2 * _size);
+    unsigned i = _free_list;
+    _free_list = _entries[i]._next;
+    _entries[i].data  = _data;
+    _entries[i]._free = false;
+    return i;
   }
 
   /**
    * Dealloc a timeout object.
    */
   unsigned dealloc(unsigned nr, bool withcancel = false) {
-    if (!nr || nr > ENTRIES - 1) return 0;
+    if (!nr || nr >= _size) return 0;
     if (_entries[nr]._free) return 0;
 
     // should only be done when no no concurrent access happens ...
     if (withcancel) cancel(nr);
     _entries[nr]._free = true;
     _entries[nr].data = 0;
+    _entries[nr]._next = _free_list;
+    _free_list = nr;
     return 1;
   }
 
   /**
-   * Cancel a programmed timeout.
+   * Cancel a programmed timeout.  Returns zero if it was the head of
+   * the queue.
    */
   int cancel(unsigned nr)
   {
-    if (!nr || nr >= ENTRIES)  return -1;
-    TimeoutEntry *current = _entries+nr;
-    if (current->_next == current) return -2;
-    int res = _entries[0]._next != current;
-
-    current->_next->_prev =  current->_prev;
-    current->_prev->_next =  current->_next;
-    current->_next = current->_prev = current;
-    return res;
+    if (!nr || nr >= _size)  return -1;
+    unsigned pos = _entries[nr]._pos;
+    if (!pos) return -2;
+
+    _entries[nr]._pos = 0;
+    if (pos != _count) {
+      _heap[pos - 1] = _heap[--_count];
+      _entries[_heap[pos - 1]]._pos = pos;
+      sift_up(pos - 1);
+      sift_down(_entries[_heap[pos - 1]]._pos - 1);
+    } else
+      _count--;
+    return pos != 1;
   }
 
 
   /**
-   * Request a new timeout.
+   * Request a new timeout.  Returns zero if the head of the queue
+   * changed.
    */
   int request(unsigned nr, timevalue to)
   {
-    if (!nr || nr > ENTRIES)  return -1;
+    if (!nr || nr >= _size)  return -1;
     timevalue old = timeout();
     TimeoutEntry *current = _entries + nr;
-    cancel(nr);
-
-    // keep a sorted list here
-    TimeoutEntry *t = _entries;
-    do { t = t->_next; }  while (t->_timeout < to);
 
-    current->_timeout = to;
-    current->_next = t;
-    current->_prev = t->_prev;
-    t->_prev->_next = current;
-    t->_prev = current;
+    if (current->_pos) {
+      // move it within the heap
+      timevalue prev = current->_timeout;
+      current->_timeout = to;
+      if (to < prev) sift_up(current->_pos - 1); else sift_down(current->_pos - 1);
+    } else {
+      current->_timeout = to;
+      _heap[_count++] = nr;
+      current->_pos = _count;
+      sift_up(_count - 1);
+    }
     return timeout() == old;
   }
 
@@ -165,8 +237,8 @@ public:
    * Get the head of the queue.
    */
   unsigned  trigger(timevalue now, DATA ** data = 0) {
-    if (now >= timeout()) {
-      unsigned i = _entries[0]._next - _entries;
+    if (_count && now >= timeout()) {
+      unsigned i = _heap[0];
       if (data)
         *data = _entries[i].data;
       return i;
@@ -174,18 +246,21 @@ public:
     return 0;
   }
 
-  timevalue timeout() { assert(_entries[0]._next); return _entries[0]._next->_timeout; }
+  timevalue timeout() { return _count ? _entries[_heap[0]]._timeout : ~0ULL; }
   void init()
   {
-    for (unsigned i = 0; i < ENTRIES; i++)
+    _count     = 0;
+    _free_list = 0;
+    for (unsigned i = _size - 1; i > 0; i--)
       {
-        _entries[i]._prev = _entries + i;
-        _entries[i]._next = _entries + i;
+        _entries[i]._pos  = 0;
         _entries[i].data  = 0;
         _entries[i]._free = true;
+        _entries[i]._next = _free_list;
+        _free_list = i;
       }
-    _entries[0]._timeout = ~0ULL;
   }
 
-  TimeoutList() { init(); }
+  TimeoutList() : _entries(0), _heap(0), _size(0), _count(0), _free_list(0) { grow(ENTRIES > 1 ? ENTRIES : 2); }
+  ~TimeoutList() { delete [] _entries; delete [] _heap; }
 };
@@ -47,6 +47,7 @@ struct CpuMessage {
           unsigned  io_order;
           unsigned  short port;
           void     *dst;
+          unsigned  io_count; // elements of a block transfer or zero
         };
       };
     };
@@ -69,8 +70,8 @@ struct CpuMessage {
 
   CpuMessage(Type _type, CpuState *_cpu, unsigned _mtr_in) : type(_type), cpu(_cpu), mtr_in(_mtr_in), mtr_out(0), consumed(0) { if (type == TYPE_CPUID) cpuid_index = cpu->eax; }
   CpuMessage(unsigned _nr, unsigned _reg, unsigned _mask, unsigned _value) : type(TYPE_CPUID_WRITE), nr(_nr), reg(_reg), mask(_mask), value(_value), consumed(0) {}
-  CpuMessage(bool is_in, CpuState *_cpu, unsigned _io_order, unsigned _port, void *_dst, unsigned _mtr_in)
-  : type(is_in ? TYPE_IOIN : TYPE_IOOUT), cpu(_cpu), io_order(_io_order), port(_port), dst(_dst), mtr_in(_mtr_in), mtr_out(0), consumed(0) {}
+  CpuMessage(bool is_in, CpuState *_cpu, unsigned _io_order, unsigned _port, void *_dst, unsigned _mtr_in, unsigned _io_count = 0)
+  : type(is_in ? TYPE_IOIN : TYPE_IOOUT), cpu(_cpu), io_order(_io_order), port(_port), dst(_dst), io_count(_io_count), mtr_in(_mtr_in), mtr_out(0), consumed(0) {}
 };
 
 
@@ -84,7 +85,8 @@ struct LapicEvent {
   enum Type{
     INTA,
     RESET,
-    INIT
+    INIT,
+    POSTED   // handle the vectors and events posted to the LAPIC
   } type;
   unsigned value;
   LapicEvent(Type _type) : type(_type) { if (type == INTA) value = ~0u; }
@@ -100,6 +102,7 @@ public:
   DBus<LapicEvent>       bus_lapic;
   DBus<MessageMem>       mem;
   DBus<MessageMemRegion> memregion;
+  DBus<MessageTimeout>   bus_timeout;
 
   VCpu *get_last() { return _last; }
   bool is_ap()     { return _last; }
@@ -122,7 +125,8 @@ public:
     EVENT_DEBUG  = 1 << 17,
     STATE_BLOCK  = 1 << 18,
     STATE_WAKEUP = 1 << 19,
-    EVENT_HOST   = 1 << 20
+    EVENT_HOST   = 1 << 20,
+    EVENT_POSTED = 1 << 21   // the LAPIC has posted vectors or events
   };
 
   unsigned long long inj_count;
@@ -70,8 +70,9 @@ protected:
     uint32 astate = 0;
 
     //Logging::printf("sum_simple %u %u\n", size, odd);
+    // Complete the word that was started by an odd byte.
     if (odd and (size != 0)) {
-      astate += *(buf++);
+      astate += *(buf++) << 8;
       size--;
       odd = false;
       //Logging::printf("corrected initial oddness: %u %u\n", size, odd);
@@ -84,13 +85,13 @@ protected:
       size -= 2;
     }
 
+    // A trailing byte starts a word that the next call completes. If
+    // there is nothing to sum, we keep the oddness of the caller.
     if (size != 0) {
-      // XXX Correct?
       astate += *buf;
       odd = true;
       //Logging::printf("Odd bytes. beware...\n");
-    } else
-      odd = false;
+    }
 
     //Logging::printf("<- %u %u\n", size, odd);
     return astate;
@@ -147,12 +148,9 @@ protected:
 #warning SSSE3 not available
     sum = _mm_add_epi32(sum, _mm_srli_si128(sum, 4));
 #endif
-    if (odd) {
-      // XXX
-      Logging::printf("sse_final ODD %08x -> %04x -> %04x\n", _mm_cvtsi128_si32(sum),
-                      fixup(_mm_cvtsi128_si32(sum)), Endian::hton16(fixup(_mm_cvtsi128_si32(sum))));
+    if (odd)
       return Endian::hton16(fixup(_mm_cvtsi128_si32(sum)));
-    } else
+    else
       return _mm_cvtsi128_si32(sum);
   }
 #endif
@@ -221,16 +219,13 @@ public:
     return ~fixup(state);
   }
 
-  /// Compute TCP/UDP checksum. proto is 17 for UDP and 6 for TCP.
-  static uint16
-  tcpudpsum(const uint8 *buf, uint8 proto,
-	    unsigned maclen, unsigned iplen,
-	    unsigned len, bool ipv6 = false)
+  /// Start a TCP/UDP checksum with the pseudo header. proto is 17 for
+  /// UDP and 6 for TCP. len is the length of the whole packet.
+  static void
+  pseudosum(const uint8 *buf, uint8 proto,
+            unsigned maclen, unsigned iplen,
+            unsigned len, bool ipv6, uint32 &state, bool &odd)
   {
-    //Logging::printf("--- tcpudpsum(%p) \n", buf);
-    uint32 state = 0;
-    bool   odd   = false;
-
     if (not ipv6) {
       // IPv4:
       // Source and destination IP addresses (part of pseudo header)
@@ -247,6 +242,19 @@ public:
                                  Endian::hton32(proto) };
       sum(reinterpret_cast<const uint8 *>(pseudo2), sizeof(pseudo2), state, odd);
     }
+  }
+
+  /// Compute TCP/UDP checksum. proto is 17 for UDP and 6 for TCP.
+  static uint16
+  tcpudpsum(const uint8 *buf, uint8 proto,
+	    unsigned maclen, unsigned iplen,
+	    unsigned len, bool ipv6 = false)
+  {
+    //Logging::printf("--- tcpudpsum(%p) \n", buf);
+    uint32 state = 0;
+    bool   odd   = false;
+
+    pseudosum(buf, proto, maclen, iplen, len, ipv6, state, odd);
       
     // Sum L4 header plus payload
     sum(buf + maclen + iplen, len - maclen - iplen, state, odd);
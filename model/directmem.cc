@@ -78,7 +78,7 @@ PARAM_HANDLER(mio,
 
   DirectMemDevice *dev = new DirectMemDevice(msg.ptr, dest, 1 << size);
   mb.bus_memregion.add(dev,  DirectMemDevice::receive_static<MessageMemRegion>);
-  mb.bus_mem.add(dev,        DirectMemDevice::receive_static<MessageMem>);
+  mb.bus_mem.add(dev,        DirectMemDevice::receive_static<MessageMem>, dest, 1 << size);
 
 }
 
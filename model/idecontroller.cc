@@ -223,10 +223,34 @@ private:
     return false;
   }
 
+  /**
+   * Transfer a block between the sector buffer and the data port.
+   */
+  bool transfer_block(unsigned type, unsigned &count, void *&ptr, bool in)
+  {
+    unsigned n = (512 - _bufferoffset) >> type;
+    if (_bufferoffset >= 512 || !n) return false;
+    if (count < n) n = count;
+
+    char *p = reinterpret_cast<char *>(ptr);
+    if (in)
+      memcpy(p, _buffer + _bufferoffset, n << type);
+    else
+      memcpy(_buffer + _bufferoffset, p, n << type);
+    ptr = p + (n << type);
+    count -= n;
+    _bufferoffset += n << type;
+    // reissue the command if work left
+    if (in && _bufferoffset >= 512)  issue_command(false);
+    return true;
+  }
+
+
   bool  receive(MessageIOIn &msg)
   {
     if (!((msg.port ^ PCI_BAR0) & PCI_BAR0_mask)) {
       unsigned port = msg.port & ~PCI_BAR0_mask;
+      if (msg.count) return !port && transfer_block(msg.type, msg.count, msg.ptr, true);
       if (port and msg.type != MessageIOIn::TYPE_INB) return false;
       switch (port) {
       case 0:
@@ -254,7 +278,7 @@ private:
       return true;
     }
     // alternate status register
-    if (!((msg.port ^ PCI_BAR1) & PCI_BAR1_mask) and msg.type == MessageIOIn::TYPE_INB and ((msg.port & ~PCI_BAR1_mask) == 2)) {
+    if (!((msg.port ^ PCI_BAR1) & PCI_BAR1_mask) and !msg.count and msg.type == MessageIOIn::TYPE_INB and ((msg.port & ~PCI_BAR1_mask) == 2)) {
       LOG("alternate status %x\n", _status);
       msg.value = _status;
       return true;
@@ -267,6 +291,7 @@ private:
   {
     if (!((msg.port ^ PCI_BAR0) & PCI_BAR0_mask)) {
       unsigned port = msg.port & ~PCI_BAR0_mask;
+      if (msg.count) return !port && transfer_block(msg.type, msg.count, msg.ptr, false);
       if (port and msg.type != MessageIOOut::TYPE_OUTB) return false;
       LOG("out<%d>[%d] = %x\n", msg.type, port, msg.value);
       switch (port) {
@@ -289,7 +314,7 @@ private:
 	return true;
       }
     }
-    if (!((msg.port ^ PCI_BAR1) & PCI_BAR1_mask) and msg.type == MessageIOOut::TYPE_OUTB and ((msg.port & ~PCI_BAR1_mask) == 2)) {
+    if (!((msg.port ^ PCI_BAR1) & PCI_BAR1_mask) and !msg.count and msg.type == MessageIOOut::TYPE_OUTB and ((msg.port & ~PCI_BAR1_mask) == 2)) {
       // toggle reset?
       if (_control & 4 && ~msg.value & 4) reset_device();
       _control = msg.value;
@@ -39,19 +39,16 @@ using namespace Endian;
 //  - polled mode:
 //     check every n µs for queued packets. n is configured using
 //     the txpoll_us parameter (see the comment at the bottom of
-//     this file).
+//     this file). If the queues stay idle, the interval doubles up
+//     to txpoll_max_us. Sent packets reset it to txpoll_us.
 
 // TODO
 // - handle BAR remapping
 // - RXDCTL.enable (bit 25) may be racy
 // - receive path does not set packet type in RX descriptor
 // - TX legacy descriptors
-// - interrupt thresholds
-// - don't copy packet on TX path if offloading is not used
 // - fancy offloads (SCTP CSO, IPsec, ...)
 // - CSO support with TX legacy descriptors
-// - scatter/gather support in MessageNetwork to avoid packet copy in
-//   TX path.
 
 class Model82576vf : public StaticReceiver<Model82576vf>
 {
@@ -62,6 +59,12 @@ class Model82576vf : public StaticReceiver<Model82576vf>
   DBus<MessageTimer>    &_timer;
   unsigned               _timer_nr;
 
+  // Interrupt moderation. An interrupt is delayed until the VTEITR
+  // interval of its vector has passed since the last one.
+  unsigned               _eitr_timer[3];
+  timevalue              _eitr_next[3];
+  unsigned               _eitr_pending;
+
   // Guest-physical addresses for MMIO and MSI-X regs.
   uint32 _mem_mmio;
   uint32 _mem_msix;
@@ -73,6 +76,13 @@ class Model82576vf : public StaticReceiver<Model82576vf>
   
   // TX queue polling interval in µs.
   unsigned _txpoll_us;
+  unsigned _txpoll_max_us;
+  unsigned _txpoll_cur;
+  timevalue _txpoll_next;
+
+  // Polls and polls that found packets.
+  unsigned long _txpoll_count;
+  unsigned long _txpoll_busy;
 
   // Map RX registers?
   bool _map_rx;
@@ -83,6 +93,10 @@ class Model82576vf : public StaticReceiver<Model82576vf>
   bool       _promisc;
   Mta        _mta;
 
+  // Receive-side scaling
+  uint8      _rss_key[40];
+  uint8      _rss_reta[128];
+
 #include <model/intel82576vfmmio.inc>
 #include <model/intel82576vfpci.inc>
 
@@ -126,12 +140,35 @@ class Model82576vf : public StaticReceiver<Model82576vf>
     uint8 packet_buf[64 * 1024];
     unsigned packet_cur;
 
+    enum {
+      MAX_FRAGMENTS         = 64,
+      MAX_SEGMENTS          = 128,
+      MAX_SEGMENT_FRAGMENTS = 512,
+    };
+
+    // The data descriptors of the current packet. We send their
+    // buffers directly from guest memory and complete them when the
+    // packet is sent, because the guest reuses the buffers afterwards.
+    struct {
+      uint64  addr;
+      tx_desc desc;
+    } pending[MAX_FRAGMENTS];
+    MessageNetwork::Fragment frags[MAX_FRAGMENTS];
+    unsigned pending_count;
+    bool     skip;
+
+    // The segment train of a TSO packet.
+    MessageNetwork::Packet   segments[MAX_SEGMENTS];
+    MessageNetwork::Fragment segment_frags[MAX_SEGMENT_FRAGMENTS];
+
     void reset()
     {
       memset(const_cast<uint32 *>(regs), 0, 0x100);
       regs[TXDCTL] = (n == 0) ? (1<<25) : 0;
       txdctl_old = regs[TXDCTL];
       packet_cur = 0;
+      pending_count = 0;
+      skip = false;
 
       regs[TDBAL] = 0;
       regs[TDBAH] = 0;
@@ -158,89 +195,118 @@ class Model82576vf : public StaticReceiver<Model82576vf>
       ctx[desc.idx()] = desc;
     }
 
-    void apply_segmentation(uint8 *packet, uint32 packet_len,
-			    const tx_desc &desc, bool tse)
+    // Send all segments of a TCP segmentation offload packet in one
+    // batch. The segments reference the payload in guest memory. Only
+    // their headers are built in packet_buf behind the prototype
+    // header.
+    void apply_segmentation(const tx_desc &desc)
     {
       uint32 payload_len = desc.paylen();
 
-      if (!tse) {
-	// Skip segmentation if it is not requested.
-	if (payload_len != packet_len) {
-	  Logging::printf("XXX Got %x bytes, but payload size is %x. Huh? Ignoring packet.\n", packet_len, payload_len);
-	  return;
-	}
-	apply_offload(packet, payload_len, desc);
-        MessageNetwork m(packet, packet_len, 0);
-	parent->_net.send(m);
-      } else {
-	// TCP segmentation is a bit weird, because the payload length
-	// in the TX descriptor does not include the prototype header.
-
-	uint8  cc     = desc.idx();
-	const tx_desc &cur_ctx = ctx[cc];
-	uint16 tucmd  = cur_ctx.tucmd();
-        uint8  l4t    = (tucmd >> 2) & 3;
-	bool   ipv6   = ((tucmd & 2) == 0);
-	//uint8  l4len  = (cur_ctx.raw[1]>>40) & 0xFF;
-	uint16 mss    = (cur_ctx.raw[1]>>48) & 0xFFFF;
-	uint16 iplen  =  cur_ctx.raw[0];
-	uint8  maclen = (iplen >> 9) & 0xFF;
-	iplen &= 0x1FF;
-	uint32 header_len = packet_len - payload_len;
-	uint32 data_left = payload_len;
-	uint32 data_sent = 0;
-
-	if (l4t == tx_desc::L4T_SCTP) {
-	  Logging::printf("XXX SCTP segmentation?\n");
-	  return;
-	}
-
-	if (l4t == tx_desc::L4T_UDP) {
-	  Logging::printf("XXX UDP segmentation not implemented.\n");
-	  return;
-	}
+      // TCP segmentation is a bit weird, because the payload length
+      // in the TX descriptor does not include the prototype header.
+
+      uint8  cc     = desc.idx();
+      const tx_desc &cur_ctx = ctx[cc];
+      uint16 tucmd  = cur_ctx.tucmd();
+      uint8  l4t    = (tucmd >> 2) & 3;
+      bool   ipv6   = ((tucmd & 2) == 0);
+      uint16 mss    = cur_ctx.mss();
+      uint16 iplen  = cur_ctx.iplen();
+      uint8  maclen = cur_ctx.maclen();
+      uint32 header_len = packet_cur - payload_len;
+
+      if (l4t == tx_desc::L4T_SCTP) {
+	Logging::printf("XXX SCTP segmentation?\n");
+	return;
+      }
 
-	uint16 &packet_ip4_id  = *reinterpret_cast<uint16 *>(packet + maclen + 4);
-	uint16 &packet_ip_len  = *reinterpret_cast<uint16 *>(packet + maclen + (ipv6 ? 4 : 2));
-	uint32 &packet_tcp_seq = *reinterpret_cast<uint32 *>(packet + maclen + iplen + 4);
-	uint8  &packet_tcp_flg = packet[maclen + iplen + 13];
-	uint8  tcp_orig_flg    = packet_tcp_flg;
+      if (l4t == tx_desc::L4T_UDP) {
+	Logging::printf("XXX UDP segmentation not implemented.\n");
+	return;
+      }
 
-	unsigned i = 0;
-	while (data_left > 0) {
-	  uint16 chunk_size = (data_left > mss) ? mss : data_left;
-	  data_left -= chunk_size;
-	  
-	  packet_ip_len = hton16(chunk_size + header_len - maclen);
+      if ((payload_len > packet_cur) || (header_len < maclen + iplen + 20U) || (mss == 0)) {
+	Logging::printf("XXX Bad TSO packet (%x bytes, payload %x, mss %x). Skipping packet\n",
+			packet_cur, payload_len, mss);
+	return;
+      }
 
-	  if (l4t == tx_desc::L4T_TCP)
-	    packet_tcp_flg = tcp_orig_flg &
-	      ((data_left == 0) ? /* last */ 0xFF : /* intermediate: set FIN/PSH */ ~9);
+      uint8 *proto = packet_buf;
+      MessageNetwork(frags, pending_count, packet_cur, 0).copy(proto, header_len);
+      uint16 ip4_id  = ntoh16(*reinterpret_cast<uint16 *>(proto + maclen + 4));
+      uint32 tcp_seq = ntoh32(*reinterpret_cast<uint32 *>(proto + maclen + iplen + 4));
+      uint8  tcp_flg = proto[maclen + iplen + 13];
+
+      // Skip the header in the guest fragments.
+      unsigned frag     = 0;
+      uint32   frag_off = header_len;
+      while (frag < pending_count && frag_off >= frags[frag].len)
+	frag_off -= frags[frag++].len;
+
+      unsigned packets = 0;
+      unsigned count   = 0;
+      uint32   hdr_off = header_len;
+      uint32 data_left = payload_len;
+      while (data_left > 0) {
+	uint32 chunk_size = (data_left > mss) ? mss : data_left;
+	data_left -= chunk_size;
+
+	// A segment needs a header and at most all guest fragments.
+	if ((packets == MAX_SEGMENTS) || (count + 1 + pending_count > MAX_SEGMENT_FRAGMENTS) ||
+	    (hdr_off + header_len > sizeof(packet_buf))) {
+	  MessageNetwork m(segments, packets, 0);
+	  parent->send(m);
+	  packets = count = 0;
+	  hdr_off = header_len;
+	}
 
-	  // Move packet data
-	  if (data_sent != 0) memmove(packet + header_len,
-				      packet + header_len + data_sent,
-				      chunk_size);
-	  
-	  // At this point we have prepared the final packet, we just
-	  // need to fix checksums and off it goes...
-	  uint32 segment_len = header_len + chunk_size;
-	  apply_offload(packet, segment_len, desc);
-	  MessageNetwork m(packet, segment_len, 0);
-	  parent->_net.send(m);
-
-	  // Prepare next chunk
-	  data_sent += chunk_size;
-	  if (!ipv6) packet_ip4_id = hton16(ntoh16(packet_ip4_id) + 1);
-	  if (l4t == tx_desc::L4T_TCP) packet_tcp_seq = hton32(ntoh32(packet_tcp_seq) + chunk_size);
-	  i++;
+	uint8 *hdr = packet_buf + hdr_off;
+	hdr_off   += header_len;
+	memcpy(hdr, proto, header_len);
+
+	// The IPv6 payload length does not include the IPv6 header.
+	*reinterpret_cast<uint16 *>(hdr + maclen + (ipv6 ? 4 : 2)) =
+	  hton16(chunk_size + header_len - maclen - (ipv6 ? 40 : 0));
+	if (!ipv6) *reinterpret_cast<uint16 *>(hdr + maclen + 4) = hton16(ip4_id++);
+	*reinterpret_cast<uint32 *>(hdr + maclen + iplen + 4) = hton32(tcp_seq);
+	tcp_seq += chunk_size;
+
+	// Intermediate segments must not have FIN/PSH set.
+	if (data_left) hdr[maclen + iplen + 13] = tcp_flg & ~9;
+
+	MessageNetwork::Packet &p = segments[packets++];
+	p.fragments = segment_frags + count;
+	p.len       = header_len + chunk_size;
+	segment_frags[count].buffer = hdr;
+	segment_frags[count++].len  = header_len;
+	for (uint32 left = chunk_size; left; ) {
+	  uint32 len = frags[frag].len - frag_off;
+	  if (len > left) len = left;
+	  if (len) {
+	    segment_frags[count].buffer = frags[frag].buffer + frag_off;
+	    segment_frags[count++].len  = len;
+	  }
+	  left     -= len;
+	  frag_off += len;
+	  if (frag_off == frags[frag].len) { frag++; frag_off = 0; }
 	}
-	//Logging::panic("INSPECT");
+	p.fragcount = segment_frags + count - p.fragments;
+
+	// The checksums are computed over the new header and the
+	// payload in guest memory.
+	apply_offload(hdr, header_len, p.len, desc, p.fragments + 1, p.fragcount - 1);
       }
+
+      MessageNetwork m(segments, packets, 0);
+      parent->send(m);
     }
 
-    void apply_offload(uint8 *packet, uint32 packet_len,
-                       const tx_desc &tx_desc)
+    // The first header_len bytes of the packet are in our buffer, the
+    // remaining ones in the rest fragments.
+    void apply_offload(uint8 *packet, uint32 header_len, uint32 packet_len,
+                       const tx_desc &tx_desc,
+                       const MessageNetwork::Fragment *rest = 0, unsigned restcount = 0)
     {
       uint8 popts = tx_desc.popts();
       // Short-Circuit return, if no interesting offloads are to be done.
@@ -253,7 +319,7 @@ class Model82576vf : public StaticReceiver<Model82576vf>
 
       // Sanity check maclen and iplen. We only cover the case that is
       // harmful to us.
-      if ((maclen+iplen > packet_len)) 
+      if ((maclen+iplen > header_len))
 	return;
 
       if ((popts & 4) != 0 /* IPSEC */) {
@@ -279,8 +345,14 @@ class Model82576vf : public StaticReceiver<Model82576vf>
           {
             uint8 *l4_sum = packet + maclen + iplen + ((l4t == tx_desc::L4T_UDP) ? 6 : 16);
             l4_sum[0] = l4_sum[1] = 0;
-            uint16 sum = IPChecksum::tcpudpsum(packet, (l4t == tx_desc::L4T_UDP) ? 17 : 6, maclen, iplen, packet_len,
-                                               (tucmd & 2 /* IPv4 */) == 0);
+            uint32 state = 0;
+            bool   odd   = false;
+            IPChecksum::pseudosum(packet, (l4t == tx_desc::L4T_UDP) ? 17 : 6, maclen, iplen, packet_len,
+                                  (tucmd & 2 /* IPv4 */) == 0, state, odd);
+            IPChecksum::sum(packet + maclen + iplen, header_len - maclen - iplen, state, odd);
+            for (unsigned i = 0; i < restcount; i++)
+              IPChecksum::sum(rest[i].buffer, rest[i].len, state, odd);
+            uint16 sum = ~IPChecksum::fixup(state);
 	    l4_sum[0] = sum;
 	    l4_sum[1] = sum>>8;
           }
@@ -295,6 +367,67 @@ class Model82576vf : public StaticReceiver<Model82576vf>
       }
     }
 
+    // Write back the descriptors of the current packet.
+    void complete()
+    {
+      bool irq = false;
+      for (unsigned i = 0; i < pending_count; i++) {
+        tx_desc &desc = pending[i].desc;
+        if ((desc.dcmd() & (1<<3) /* Report Status */) != 0) irq = true;
+        desc.set_done();
+        parent->copy_out(pending[i].addr, desc.raw, sizeof(desc));
+      }
+      pending_count = 0;
+      if (irq) parent->TX_irq(n);
+    }
+
+    void send_packet(const tx_desc &desc, bool tse)
+    {
+      if (tse) {
+        apply_segmentation(desc);
+        return;
+      }
+
+      if (desc.paylen() != packet_cur) {
+        Logging::printf("XXX Got %x bytes, but payload size is %x. Huh? Ignoring packet.\n", packet_cur, desc.paylen());
+        return;
+      }
+
+      if ((desc.popts() & 7) == 0) {
+        MessageNetwork m(frags, pending_count, packet_cur, 0);
+        parent->send(m);
+        return;
+      }
+
+      // Checksum offloads only modify the headers. We copy them and
+      // send the payload from guest memory.
+      unsigned cc = desc.idx();
+      uint32 header_len = ctx[cc].maclen() + ctx[cc].iplen() + 20 /* TCP header */;
+      if (header_len > packet_cur) header_len = packet_cur;
+
+      MessageNetwork::Fragment out[MAX_FRAGMENTS + 1];
+      unsigned count  = 1;
+      uint32   copied = 0;
+      for (unsigned i = 0; i < pending_count; i++) {
+        uint32 len = 0;
+        if (copied < header_len) {
+          len = frags[i].len < header_len - copied ? frags[i].len : header_len - copied;
+          memcpy(packet_buf + copied, frags[i].buffer, len);
+          copied += len;
+        }
+        if (len == frags[i].len) continue;
+        out[count].buffer = frags[i].buffer + len;
+        out[count].len    = frags[i].len - len;
+        count++;
+      }
+      out[0].buffer = packet_buf;
+      out[0].len    = header_len;
+
+      apply_offload(packet_buf, header_len, packet_cur, desc, out + 1, count - 1);
+      MessageNetwork m(out, count, packet_cur, 0);
+      parent->send(m);
+    }
+
     void handle_dta(uint64 addr, tx_desc &desc)
     {
       uint32 data_len = desc.dtalen();
@@ -313,58 +446,66 @@ class Model82576vf : public StaticReceiver<Model82576vf>
         TSE = 128,
       };
 
-      const uint8 *data = reinterpret_cast<uint8 *>(parent->guestmem(desc.raw[0]));
-
       if ((dcmd & IFCS) == 0)
         Logging::printf("IFCS not set, but we append FCS anyway in host82576vf.\n");
 
-      // XXX Check if offloading is used. If not -> send directly from
-      // guestmem.
-      if ((packet_cur + data_len) > sizeof(packet_buf)) {
-	Logging::printf("XXX Packet buffer too small? Skipping packet\n");
-	packet_cur = 0;
-	goto done;
+      if (pending_count == MAX_FRAGMENTS) {
+	Logging::printf("XXX Too many TX fragments. Skipping packet\n");
+	complete();
+	skip = true;
       }
 
-      memcpy(packet_buf + packet_cur, data, data_len);
-      packet_cur += data_len;
+      unsigned i = pending_count++;
+      pending[i].addr = addr;
+      pending[i].desc = desc;
 
-      if (dcmd & EOP) {
-	apply_segmentation(packet_buf, packet_cur, desc, (dcmd & TSE) != 0);
-        packet_cur = 0;
+      if (skip) {
+	// Drop the rest of the packet.
+      } else if ((packet_cur + data_len) > sizeof(packet_buf)) {
+	Logging::printf("XXX Packet buffer too small? Skipping packet\n");
+	skip = true;
+      } else if (!(frags[i].buffer = parent->guest_ptr(desc.raw[0], data_len))) {
+	Logging::printf("TX buffer %llx+%x is not in guest memory. Skipping packet\n", (unsigned long long)desc.raw[0], data_len);
+	skip = true;
+      } else {
+	frags[i].len = data_len;
+	packet_cur += data_len;
       }
 
-    done:
-      // Descriptor is done
-      desc.set_done();
-      parent->copy_out(addr, desc.raw, sizeof(desc));
-      if ((dcmd & (1<<3) /* Report Status */) != 0)
-        parent->TX_irq(n);
+      if (dcmd & EOP) {
+	if (!skip) send_packet(desc, (dcmd & TSE) != 0);
+	complete();
+	packet_cur = 0;
+	skip = false;
+      }
     }
 
-    void tdt_poll()
+    // Returns true if descriptors were processed.
+    bool tdt_poll()
     {
       if ((regs[TXDCTL] & (1<<25)) == 0) {
 	//if (n == 0) Logging::printf("TX: Queue %u not enabled.\n", n);
-	return;
+	return false;
       }
       uint32 tdlen = regs[TDLEN];
       if (tdlen == 0) {
 	//if (n == 0) Logging::printf("TX: Queue %u has zero size.\n", n);
-	return;
+	return false;
       }
 
       uint32 tdbah = regs[TDBAH];
       uint32 tdbal = regs[TDBAL];
 
       // Packet send loop.
+      bool   work = false;
       uint32 tdh;
       while ((tdh = regs[TDH]) != regs[TDT]) {
 	uint64 addr = (static_cast<uint64>(tdbah)<<32 | tdbal) + ((tdh*16) % tdlen);
 	tx_desc desc;
 
 	if (!parent->copy_in(addr, desc.raw, sizeof(desc)))
-	  return;
+	  return work;
+	work = true;
 	if ((desc.raw[1] & (1<<29)) == 0) {
 	  Logging::printf("TX legacy descriptor: Not implemented!\n");
 	} else {
@@ -381,6 +522,7 @@ class Model82576vf : public StaticReceiver<Model82576vf>
 	VMM_MEMORY_BARRIER;
 	regs[TDH] = (((tdh+1)*16 ) % tdlen) / 16;
       }
+      return work;
     }
 
     uint32 read(uint32 offset)
@@ -471,7 +613,7 @@ class Model82576vf : public StaticReceiver<Model82576vf>
       rxdctl_old = rxdctl_new;
     }
 
-    void receive_packet(uint8 *buf, size_t size)
+    void receive_packet(uint8 *buf, size_t size, uint32 rss_hash, unsigned rss_type)
     {
       // Check early if this packet is for us.
 
@@ -525,8 +667,8 @@ class Model82576vf : public StaticReceiver<Model82576vf>
       case 1:			// Advanced, one buffer
 	{
 	  uint64 target_buf = desc.advanced_read.pbuffer;
-	  desc.advanced_write.rss_hash = 0;
-	  desc.advanced_write.info = 0;
+	  desc.advanced_write.rss_hash = rss_hash;
+	  desc.advanced_write.info = rss_type;
 	  desc.advanced_write.vlan = 0;
 	  desc.advanced_write.len = size;
 	  if (!parent->copy_out(target_buf, buf, size))
@@ -554,6 +696,12 @@ class Model82576vf : public StaticReceiver<Model82576vf>
   tx_queue _tx_queues[2];
   rx_queue _rx_queues[2];
 
+  // Set while we send a packet to the network bus.
+  bool _sending;
+
+  // Fragmented packets are linearized here on receive.
+  uint8 _rx_buf[64 * 1024];
+
   // Software interface
   enum MBX {
     VF_RESET         = 0x0001U,
@@ -584,23 +732,40 @@ class Model82576vf : public StaticReceiver<Model82576vf>
     return 0;
   }
 
-  void *guestmem(uint64 addr)
+  // The moderation interval of a vector in microseconds.
+  unsigned EITR_interval(unsigned nr)
   {
-    MessageMemRegion msg(addr >> 12);
-    if (!_bus_memregion->send(msg) || !msg.ptr)
-      Logging::panic("Address translation failed.\n");
-    return msg.ptr + addr - (msg.start_page << 12);
+    uint32 eitr = (nr == 0) ? rVTEITR0 : ((nr == 1) ? rVTEITR1 : rVTEITR2);
+    return (eitr >> 2) & 0x1FFF;
   }
 
   // Generate a MSI-X IRQ.
   void MSIX_irq(unsigned nr)
   {
-    // Logging::printf("MSI-X IRQ %d | EIMS %02x | EIAC %02x | EIAM %02x | C %02x\n", nr,
-    // 		    rVTEIMS, rVTEIAC, rVTEIAM, _msix.table[nr].vector_control);
     uint32 mask = 1<<nr;
     // Set interrupt cause.
     rVTEICR |= mask;
 
+    // Coalesce with an interrupt that is already delayed.
+    if ((_eitr_pending & mask) != 0) return;
+
+    if ((EITR_interval(nr) != 0) && (_clock->time() < _eitr_next[nr])) {
+      _eitr_pending |= mask;
+      MessageTimer msg(_eitr_timer[nr], _eitr_next[nr]);
+      if (!_timer.send(msg))
+	Logging::panic("%s could not program timer.", __PRETTY_FUNCTION__);
+      return;
+    }
+
+    MSIX_send(nr);
+  }
+
+  void MSIX_send(unsigned nr)
+  {
+    // Logging::printf("MSI-X IRQ %d | EIMS %02x | EIAC %02x | EIAM %02x | C %02x\n", nr,
+    // 		    rVTEIMS, rVTEIAC, rVTEIAM, _msix.table[nr].vector_control);
+    uint32 mask = 1<<nr;
+
     if ((mask & rVTEIMS) != 0) {
       if ((_msix.table[nr].vector_control & 1) == 0) {
 	// Logging::printf("Generating MSI-X IRQ %d (%02x)\n", nr, _msix.table[nr].msg_data & 0xFF);
@@ -613,6 +778,9 @@ class Model82576vf : public StaticReceiver<Model82576vf>
 	rVTEICR &= ~(mask & rVTEIAC);
 	rVTEIMS &= ~(mask & rVTEIAM);
 	// Logging::printf("MSI-X -> EIMS %02x\n", rVTEIMS);
+
+	unsigned interval = EITR_interval(nr);
+	if (interval != 0) _eitr_next[nr] = _clock->abstime(interval, 1000000);
       }
     }
   }
@@ -640,7 +808,12 @@ class Model82576vf : public StaticReceiver<Model82576vf>
 
   void VTEITR_cb(uint32 old, uint32 val)
   {
-    // Do nothing. Not implemented.
+    // Deliver delayed interrupts, if moderation was switched off.
+    for (unsigned i = 0; i < 3; i++)
+      if (((_eitr_pending & (1<<i)) != 0) && (EITR_interval(i) == 0)) {
+	_eitr_pending &= ~(1<<i);
+	MSIX_send(i);
+      }
   }
 
   void VMMB_cb(uint32 old, uint32 val)
@@ -713,10 +886,115 @@ class Model82576vf : public StaticReceiver<Model82576vf>
   {
     if ((old ^ val) & (1<<26 /* Reset */)) {
       MMIO_init();
+      RSS_cb(0, 0);
       // XXX Anything else to do here?
     }
   }
 
+  enum {
+    MRQC_TCPIPV4 = 1 << 16,
+    MRQC_IPV4    = 1 << 17,
+    MRQC_IPV6    = 1 << 20,
+    MRQC_TCPIPV6 = 1 << 21,
+    MRQC_UDPIPV4 = 1 << 22,
+    MRQC_UDPIPV6 = 1 << 23,
+
+    RSS_TCPIPV4  = 1,
+    RSS_IPV4     = 2,
+    RSS_TCPIPV6  = 3,
+    RSS_IPV6     = 5,
+    RSS_UDPIPV4  = 7,
+    RSS_UDPIPV6  = 8,
+  };
+
+  // Cache the redirection table and the key as bytes.
+  void RSS_cb(uint32 old, uint32 val)
+  {
+    for (unsigned i = 0; i < sizeof(_rss_reta); i += 4) {
+      uint32 v = MMIO_read(0x1C00 + i);
+      memcpy(_rss_reta + i, &v, sizeof(v));
+    }
+    for (unsigned i = 0; i < sizeof(_rss_key); i += 4) {
+      uint32 v = MMIO_read(0x1C80 + i);
+      memcpy(_rss_key + i, &v, sizeof(v));
+    }
+  }
+
+  static uint32 toeplitz(const uint8 *key, const uint8 *data, unsigned len)
+  {
+    uint32 hash   = 0;
+    uint32 window = key[0] << 24 | key[1] << 16 | key[2] << 8 | key[3];
+    for (unsigned i = 0; i < len; i++)
+      for (int b = 7; b >= 0; b--) {
+	if (data[i] & (1 << b)) hash ^= window;
+	window = (window << 1) | ((key[i + 4] >> b) & 1);
+      }
+    return hash;
+  }
+
+  // Select the RX queue of a packet by hashing its addresses and
+  // ports as configured in MRQC.
+  unsigned RSS_queue(const uint8 *buf, size_t size, uint32 &hash, unsigned &type)
+  {
+    hash = 0;
+    type = 0;
+    uint32 mrqc = rVTMRQC;
+    if ((mrqc & 7) == 0 || size < 14) return 0;
+
+    unsigned off = 12;
+    uint16 ethertype = buf[off] << 8 | buf[off + 1];
+    if (ethertype == 0x8100 && size >= 18) {
+      off += 4;
+      ethertype = buf[off] << 8 | buf[off + 1];
+    }
+    off += 2;
+
+    uint8  input[36];
+    unsigned len = 0;
+    const uint8 *ip = buf + off;
+    const uint8 *l4;
+    uint8 proto;
+    bool  frag = false;
+    if (ethertype == 0x0800 && size >= off + 20) {
+      memcpy(input, ip + 12, 8);
+      len   = 8;
+      proto = ip[9];
+      frag  = ((ip[6] & 0x3F) | ip[7]) != 0;
+      l4    = ip + (ip[0] & 0xF) * 4;
+      if      (proto == 6  && (mrqc & MRQC_TCPIPV4)) type = RSS_TCPIPV4;
+      else if (proto == 17 && (mrqc & MRQC_UDPIPV4)) type = RSS_UDPIPV4;
+      else if (mrqc & MRQC_IPV4)                     type = RSS_IPV4;
+      else return 0;
+    } else if (ethertype == 0x86DD && size >= off + 40) {
+      memcpy(input, ip + 8, 32);
+      len   = 32;
+      proto = ip[6];
+      l4    = ip + 40;
+      if      (proto == 6  && (mrqc & MRQC_TCPIPV6)) type = RSS_TCPIPV6;
+      else if (proto == 17 && (mrqc & MRQC_UDPIPV6)) type = RSS_UDPIPV6;
+      else if (mrqc & MRQC_IPV6)                     type = RSS_IPV6;
+      else return 0;
+    } else return 0;
+
+    // Fragments and truncated packets are only hashed by address.
+    if (type != RSS_IPV4 && type != RSS_IPV6) {
+      if (!frag && l4 + 4 <= buf + size) {
+	memcpy(input + len, l4, 4);
+	len += 4;
+      } else {
+	bool ipv4 = (type == RSS_TCPIPV4 || type == RSS_UDPIPV4);
+	if (!(mrqc & (ipv4 ? MRQC_IPV4 : MRQC_IPV6))) {
+	  type = 0;
+	  return 0;
+	}
+	type = ipv4 ? RSS_IPV4 : RSS_IPV6;
+      }
+    }
+
+    hash = toeplitz(_rss_key, input, len);
+    return _rss_reta[hash & 0x7F] & 1;
+  }
+
   void VTEICS_cb(uint32 old, uint32 val)
   {
     for (unsigned i = 0; i < 3; i++)
@@ -781,7 +1059,10 @@ public:
       //Logging::printf("MMIO WRITE %lx\n", offset);
       switch (offset >> 12) {
       case 2: _rx_queues[(offset & 0x100) ? 1 : 0].write(offset, *msg.ptr); break;
-      case 3: _tx_queues[(offset & 0x100) ? 1 : 0].write(offset, *msg.ptr); break;
+      case 3:
+	_tx_queues[(offset & 0x100) ? 1 : 0].write(offset, *msg.ptr);
+	if (_txpoll_us != 0) txpoll_kick();
+	break;
       default: MMIO_write(msg.phys - (rPCIBAR0 & ~0x3FFF), *msg.ptr); break;
       }
     } else if ((msg.phys & ~0xFFF) == (rPCIBAR3 & ~0xFFF)) {
@@ -792,25 +1073,68 @@ public:
 
   bool receive(MessageNetwork &msg)
   {
-    // XXX Hack. Avoid our own packets.
-    if (!(((msg.buffer < _tx_queues[0].packet_buf) ||
-	   (msg.buffer >= (_tx_queues[0].packet_buf + sizeof(_tx_queues[0].packet_buf)))) &&
-	  ((msg.buffer < _tx_queues[1].packet_buf) ||
-	   (msg.buffer >= (_tx_queues[1].packet_buf + sizeof(_tx_queues[1].packet_buf))))))
-      return false;
+    // Avoid our own packets.
+    if (_sending) return false;
+
+    if (msg.type == MessageNetwork::PACKETS) {
+      for (unsigned i = 0; i < msg.packetcount; i++) {
+        MessageNetwork m = msg.packet(i);
+        receive(m);
+      }
+      return true;
+    }
+    if (msg.type != MessageNetwork::PACKET) return false;
+
+    uint8 *buf  = const_cast<uint8 *>(msg.buffer);
+    size_t  len = msg.len;
+    if (!buf) {
+      if (msg.len > sizeof(_rx_buf)) return false;
+      buf = _rx_buf;
+      len = msg.copy(_rx_buf, sizeof(_rx_buf));
+    }
 
-    _rx_queues[0].receive_packet(const_cast<uint8 *>(msg.buffer), msg.len);
+    uint32   hash;
+    unsigned type;
+    unsigned queue = RSS_queue(buf, len, hash, type);
+    _rx_queues[queue].receive_packet(buf, len, hash, type);
     return true;
   }
 
-  void reprogram_timer()
+  void send(MessageNetwork &msg)
+  {
+    _sending = true;
+    _net.send(msg);
+    _sending = false;
+  }
+
+  // Return our pointer to a guest buffer, if it is backed by a single
+  // memory region.
+  uint8 *guest_ptr(uint64 addr, size_t len)
+  {
+    MessageMemRegion msg(addr >> 12);
+    if (!_bus_memregion->send(msg) || !msg.ptr ||
+        ((addr + len) > (static_cast<uint64>(msg.start_page + msg.count) << 12))) return 0;
+    return reinterpret_cast<uint8 *>(msg.ptr) + (addr - (static_cast<uint64>(msg.start_page) << 12));
+  }
+
+  void reprogram_timer(timevalue next)
   {
     assert(_txpoll_us != 0);
-    MessageTimer msgn(_timer_nr, _clock->abstime(_txpoll_us, 1000000));
+    _txpoll_next = next;
+    MessageTimer msgn(_timer_nr, next);
     if (!_timer.send(msgn))
       Logging::panic("%s could not program timer.", __PRETTY_FUNCTION__);
   }
 
+  // The guest touched the TX registers. Poll soon with the shortest
+  // interval.
+  void txpoll_kick()
+  {
+    _txpoll_cur = _txpoll_us;
+    timevalue next = _clock->abstime(_txpoll_us, 1000000);
+    if (next < _txpoll_next) reprogram_timer(next);
+  }
+
   bool receive(MessageMemRegion &msg)
   {
     switch ((msg.page) - (_mem_mmio >> 12)) {
@@ -826,7 +1150,7 @@ public:
 	msg.start_page = msg.page;
 	msg.count = 1;
 	// If TX memory is mapped, we need to poll it periodically.
-	reprogram_timer();
+	txpoll_kick();
 
 	break;
       } else {
@@ -844,14 +1168,38 @@ public:
 
   bool receive(MessageTimeout &msg)
   {
+    for (unsigned i = 0; i < 3; i++) {
+      if (msg.nr != _eitr_timer[i]) continue;
+
+      uint32 mask = 1<<i;
+      if ((_eitr_pending & mask) != 0) {
+	_eitr_pending &= ~mask;
+	// The cause may have been cleared meanwhile.
+	if ((rVTEICR & mask) != 0) MSIX_send(i);
+      }
+      return true;
+    }
+
     if (msg.nr != _timer_nr) return false;
 
+    bool work = false;
     for (unsigned i = 0; i < 2; i++) {
       _tx_queues[i].txdctl_poll();
-      _tx_queues[i].tdt_poll();
+      work |= _tx_queues[i].tdt_poll();
     }
 
-    reprogram_timer();
+    // Back off exponentially while the queues are idle.
+    _txpoll_count++;
+    if (work) {
+      _txpoll_busy++;
+      _txpoll_cur = _txpoll_us;
+    } else if (_txpoll_cur < _txpoll_max_us)
+      _txpoll_cur = (_txpoll_cur * 2 < _txpoll_max_us) ? _txpoll_cur * 2 : _txpoll_max_us;
+
+    if ((_txpoll_count & ((1 << 20) - 1)) == 0)
+      Logging::printf("82576VF TX polls %lu, busy %lu\n", _txpoll_count, _txpoll_busy);
+
+    reprogram_timer(_clock->abstime(_txpoll_cur, 1000000));
     return true;
   }
 
@@ -868,6 +1216,11 @@ public:
     }
 
     MMIO_init();
+    RSS_cb(0, 0);
+
+    _eitr_pending = 0;
+    for (unsigned i = 0; i < 3; i++)
+      _eitr_next[i] = 0;
 
     _mta.clear();
     _promisc = _promisc_default;
@@ -889,13 +1242,15 @@ public:
   Model82576vf(uint64 mac, DBus<MessageNetwork> &net,
 	       DBus<MessageMem> *bus_mem, DBus<MessageMemRegion> *bus_memregion,
 	       Clock *clock, DBus<MessageTimer> &timer,
-	       uint32 mem_mmio, uint32 mem_msix, unsigned txpoll_us, bool map_rx, unsigned bdf,
-	       bool promisc_default)
+	       uint32 mem_mmio, uint32 mem_msix, unsigned txpoll_us, unsigned txpoll_max_us,
+	       bool map_rx, unsigned bdf, bool promisc_default)
     : _mac(mac), _net(net), _bus_memregion(bus_memregion), _bus_mem(bus_mem),
       _clock(clock), _timer(timer),
       _mem_mmio(mem_mmio), _mem_msix(mem_msix),
-      _txpoll_us(txpoll_us), _map_rx(map_rx), _bdf(bdf),
-      _promisc_default(promisc_default)
+      _txpoll_us(txpoll_us), _txpoll_max_us(txpoll_max_us < txpoll_us ? txpoll_us : txpoll_max_us),
+      _txpoll_cur(txpoll_us), _txpoll_next(~0ULL), _txpoll_count(0), _txpoll_busy(0),
+      _map_rx(map_rx), _bdf(bdf),
+      _promisc_default(promisc_default), _sending(false)
   {
     Logging::printf("Attached 82576VF model at %08x+0x4000, %08x+0x1000\n",
 		    mem_mmio, mem_msix);
@@ -916,15 +1271,23 @@ public:
     if (!_timer.send(msgt))
       Logging::panic("%s can't get a timer", __PRETTY_FUNCTION__);
     _timer_nr = msgt.nr;
+
+    for (unsigned i = 0; i < 3; i++) {
+      MessageTimer msge;
+      if (!_timer.send(msge))
+	Logging::panic("%s can't get a timer", __PRETTY_FUNCTION__);
+      _eitr_timer[i] = msge.nr;
+    }
   }
 
 };
 
 PARAM_HANDLER(intel82576vf,
-	      "intel82576vf:[promisc][,mem_mmio][,mem_msix][,txpoll_us][,rx_map] - attach an Intel 82576VF to the PCI bus.",
+	      "intel82576vf:[promisc][,mem_mmio][,mem_msix][,txpoll_us][,rx_map][,txpoll_max_us] - attach an Intel 82576VF to the PCI bus.",
 	      "promisc   - if !=0, be always promiscuous (use for Linux VMs that need it for bridging) (Default 1)",
 	      "txpoll_us - if !=0, map TX registers to guest and poll them every txpoll_us microseconds. (Default 0)",
 	      "rx_map    - if !=0, map RX registers to guest. (Default: Yes)",
+	      "txpoll_max_us - the longest polling interval on idle TX queues. (Default 64*txpoll_us)",
 	      "Example: intel82576vf"
 	      )
 {
@@ -937,6 +1300,7 @@ PARAM_HANDLER(intel82576vf,
 				       (argv[1] == ~0UL) ? 0xF7CE0000 : argv[1],
 				       (argv[2] == ~0UL) ? 0xF7CC0000 : argv[2],
 				       (argv[3] == ~0UL) ? 0 : argv[3],
+				       (argv[5] == ~0UL) ? ((argv[3] == ~0UL) ? 0 : argv[3] * 64) : argv[5],
 				       argv[4],
 				       PciHelper::find_free_bdf(mb.bus_pcicfg, ~0U),
 				       (argv[0] == ~0UL) ? true : (argv[0] != 0) );
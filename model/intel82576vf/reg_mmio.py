@@ -63,6 +63,21 @@ for n in range(3):
                  'initial' : 0,
                  'callback' : 'VTEITR_cb'})
 
+# Receive-side scaling. These are PF registers on real hardware. We
+# provide them at the PF offsets minus 0x4000.
+rset.append({'name' : 'rVTMRQC', 'offset' : 0x1818, 'initial' : 0,
+             'callback' : 'RSS_cb'})
+for n in range(32):
+    rset.append({'name' : 'rVTRETA%d' % n,
+                 'offset' : 0x1C00 + 4*n,
+                 'initial' : 0,
+                 'callback' : 'RSS_cb'})
+for n in range(10):
+    rset.append({'name' : 'rVTRSSRK%d' % n,
+                 'offset' : 0x1C80 + 4*n,
+                 'initial' : 0,
+                 'callback' : 'RSS_cb'})
+
 # Mailbox memory
 for n in range(0x10):
     rset.append({'name' : 'rVFMBX%d' % n,
@@ -18,13 +18,14 @@
 
 #include "nul/motherboard.h"
 #include "nul/vcpu.h"
+#include "model/apicroute.h"
 
 /**
  * I/OxAPIC model.
  *
  * State: testing
  * Features: MSI generation, level+notify, PAR, EOI
- * Difference: no APIC bus
+ * Difference: no APIC bus, messages go directly to the LAPICs instead of the MSI address
  * Documentation: Intel ICH4.
  */
 class IOApic : public DiscoveryHelper<IOApic>, public StaticReceiver<IOApic> {
@@ -51,6 +52,8 @@ private:
   bool     _rirr  [PINS];
   bool     _ds    [PINS];
   bool     _notify[PINS];
+  ApicRoute _route[PINS];
+  unsigned _lowest_rr;
 
   /**
    * Route IRQs and return a pin to a GSI number.
@@ -71,6 +74,20 @@ private:
   }
 
 
+  /**
+   * Decode the redirection entry of a pin into the message that
+   * pin_assert() sends.
+   */
+  void update_route(unsigned pin) {
+    unsigned dst = _redir[2*pin+1];
+    unsigned value = _redir[2*pin];
+    uintptr_t phys = MessageMem::MSI_ADDRESS | (dst >> 12) & 0xffff0;
+    if (value & MessageApic::ICR_DM) phys |= MessageMem::MSI_DM;
+    if ((value & 0x700) == 0x100)    phys |= MessageMem::MSI_RH;
+    _route[pin] = ApicRoute(phys, value);
+  }
+
+
   /**
    * Read the data register.
    */
@@ -95,6 +112,7 @@ private:
       unsigned mask = (_index & 1) ? 0xffff0000 : 0x1afff;
       _redir[_index - 0x10] = value & mask;
       unsigned pin = (_index - 0x10) / 2;
+      update_route(pin);
 
       // if edge: clear ds bit
       _ds[pin] = _ds[pin] && _redir[pin * 2] & MessageApic::ICR_LEVEL;
@@ -134,7 +152,6 @@ private:
     else {
       // have we already send the message
       if (_rirr[pin]) return true;
-      unsigned dst   = _redir[2*pin+1];
       unsigned value = _redir[2*pin];
       bool level     = value & 0x8000;
       _notify[pin] = type == MessageIrq::ASSERT_NOTIFY;
@@ -144,13 +161,7 @@ private:
 
 	_rirr[pin] = level;
 	_ds[pin]   = false;
-	uintptr_t phys = MessageMem::MSI_ADDRESS | (dst >> 12) & 0xffff0;
-	if (value & MessageApic::ICR_DM) phys |= MessageMem::MSI_DM;
-	if ((value & 0x700) == 0x100)    phys |= MessageMem::MSI_RH;
-	if (_rirr[pin])                 value |= 1 << 14;
-
-	MessageMem mem(false, phys, &value);
-	_mb.bus_mem.send(mem);
+	_route[pin].send(_mb.apic_directory, _lowest_rr, level);
 	if (!level) notify(pin);
       }
     }
@@ -186,6 +197,8 @@ private:
       _redir[2*0]     = 0x10700;
       _redir[2*23]    = 0x10400;
     }
+    for (unsigned i=0; i < PINS; i++) update_route(i);
+    _lowest_rr = 0;
     _id = 0;
     _index = 0;
   }
@@ -259,7 +272,8 @@ public:
   IOApic(Motherboard &mb, uintptr_t base, unsigned gsibase) : _mb(mb), _base(base), _gsibase(gsibase)
   {
     reset();
-    _mb.bus_mem.add(this,       receive_static<MessageMem>);
+    _mb.bus_mem.add(this,       receive_static<MessageMem>, _base, 0x100);
+    _mb.bus_mem.add(this,       receive_static<MessageMem>, MessageApic::IOAPIC_EOI, 4);
     _mb.bus_irqlines.add(this,  receive_static<MessageIrqLines>);
     _mb.bus_legacy.add(this,    receive_static<MessageLegacy>);
     _mb.bus_discovery.add(this, discover);
@@ -171,7 +171,7 @@ public:
 
   bool  receive(MessageIOIn &msg)
   {
-    if (msg.type != MessageIOIn::TYPE_INB) return false;
+    if (msg.type != MessageIOIn::TYPE_INB || msg.count) return false;
     if (msg.port == _base)
       {
 	msg.value = _ram[RAM_OBF];
@@ -189,7 +189,7 @@ public:
 
   bool  receive(MessageIOOut &msg)
   {
-    if (msg.type != MessageIOOut::TYPE_OUTB) return false;
+    if (msg.type != MessageIOOut::TYPE_OUTB || msg.count) return false;
     if (msg.port == _base)
       {
 	if (~_ram[RAM_STATUS] & STATUS_NO_INHB)  return true;
@@ -352,8 +352,10 @@ PARAM_HANDLER(kbc,
 {
   static unsigned kbc_count;
   KeyboardController *dev = new KeyboardController(mb.bus_irqlines, mb.bus_ps2, mb.bus_legacy, argv[0], argv[1], argv[2], 2*kbc_count++);
-  mb.bus_ioin.add(dev,  KeyboardController::receive_static<MessageIOIn>);
-  mb.bus_ioout.add(dev, KeyboardController::receive_static<MessageIOOut>);
+  for (unsigned i = 0; i < 2; i++) {
+    mb.bus_ioin.add(dev,  KeyboardController::receive_static<MessageIOIn>,  argv[0] + 4*i, 1);
+    mb.bus_ioout.add(dev, KeyboardController::receive_static<MessageIOOut>, argv[0] + 4*i, 1);
+  }
   mb.bus_ps2.add(dev,   KeyboardController::receive_static<MessagePS2>);
   mb.bus_legacy.add(dev,KeyboardController::receive_static<MessageLegacy>);
 }
@@ -52,6 +52,7 @@ private:
   unsigned  _initial_apic_id;
   unsigned  _timer;
   unsigned  _timer_clock_shift;
+  unsigned  _apic_slot;
 
   // dynamic state
   unsigned  _timer_dcr_shift;
@@ -64,6 +65,21 @@ private:
   bool      _rirr[NUM_LVT];
   unsigned  _lowest_rr;
 
+  // fixed vectors and events posted by other threads, see post_vector()
+  // and post_event()
+  enum {
+    POST_TIMEOUT = 1 << 0,
+    POST_LINT0   = 1 << 1,
+    POST_NMI     = 1 << 2,
+    POST_ERROR   = 1 << 3,
+  };
+  unsigned  _pir[8];
+  unsigned  _pir_tmr[8];
+  unsigned  _pir_deass[8];
+  volatile unsigned _posted;
+  volatile unsigned _notified;
+  volatile bool     _lint0;
+
 
   bool sw_disabled() { return ~_SVR & 0x100; }
   bool hw_disabled() { return ~_msr & 0x800; }
@@ -71,6 +87,15 @@ private:
   unsigned x2apic_ldr() { return ((_initial_apic_id & ~0xf) << 12) | ( 1 << (_initial_apic_id & 0xf)); }
 
 
+  /**
+   * Tell the APIC directory where to deliver messages for us.
+   */
+  void update_directory() {
+    _mb.apic_directory.update(_apic_slot, !hw_disabled(), x2apic_mode(), _ID,
+			      x2apic_mode() ? x2apic_ldr() : _LDR, (_DFR >> 28) == 0xf);
+  }
+
+
   /**
    * Handle an INIT signal.
    */
@@ -85,6 +110,9 @@ private:
     // init dynamic state
     _timer_dcr_shift = 1 + _timer_clock_shift;
     memset(_vector,  0, sizeof(_vector));
+    memset(_pir,     0, sizeof(_pir));
+    memset(_pir_tmr, 0, sizeof(_pir_tmr));
+    memset(_pir_deass, 0, sizeof(_pir_deass));
     memset(_lvtds,   0, sizeof(_lvtds));
     memset(_rirr,    0, sizeof(_rirr));
     _isrv = 0;
@@ -94,6 +122,7 @@ private:
 
     _ID = old_id;
     _lvtds[_LINT0_offset - LVT_BASE] = lint0;
+    update_directory();
 
 
     update_irqs();
@@ -145,6 +174,7 @@ private:
 
     // set them to default state if disabled
     if (hw_disabled()) init();
+    update_directory();
     return true;
   }
 
@@ -237,10 +267,10 @@ private:
 
       // we could set an send accept error here if nobody got the
       // message, but that is not supported in the P4...
-      return _mb.bus_apic.send_rr(msg, _lowest_rr);
+      return _mb.apic_directory.send_rr(msg, _lowest_rr);
     }
     MessageApic msg(icr, dst, shorthand == 3 ? this : 0);
-    return _mb.bus_apic.send(msg);
+    return _mb.apic_directory.send(msg);
   }
 
 
@@ -327,6 +357,81 @@ private:
     update_irqs();
   }
 
+  /**
+   * Accept a fixed vector from another CPU without touching the IRR.
+   * The vector is set in the PIR and our CPU is notified once, which
+   * folds all posted vectors into the IRR before it prioritizes its
+   * events.
+   */
+  void post_vector(unsigned char vector, bool level) {
+    // an assert overrides an earlier deassert that was not folded yet
+    Cpu::atomic_set_bit(_pir_deass, vector, false);
+    if (level) Cpu::atomic_set_bit(_pir_tmr, vector);
+    Cpu::atomic_set_bit(_pir, vector);
+    notify();
+  }
+
+  /**
+   * Deassert a level-triggered vector from another CPU.  It may still
+   * be posted, thus the deassert is posted as well and applied after
+   * the PIR is folded.
+   */
+  void post_deassert(unsigned char vector) {
+    Cpu::atomic_set_bit(_pir, vector, false);
+    Cpu::atomic_set_bit(_pir_deass, vector);
+    notify();
+  }
+
+  /**
+   * Defer an event from another thread to our CPU, as only its
+   * thread may touch the timer, the LVT and the error state.  Our
+   * CPU is notified once and handles all posted events before it
+   * prioritizes its own.
+   */
+  void post_event(unsigned event) {
+    Cpu::atomic_or<volatile unsigned>(&_posted, event);
+    notify();
+  }
+
+  void notify() {
+    if (Cpu::xchg(&_notified, 1U)) return;
+
+    CpuEvent msg(VCpu::EVENT_POSTED);
+    _vcpu->bus_event.send(msg);
+  }
+
+  /**
+   * Move the posted vectors to the IRR and TMR and handle the posted
+   * events.  Only called on the thread of our CPU.
+   */
+  void fold_posted() {
+    if (!Cpu::xchg(&_notified, 0U)) return;
+    for (unsigned i=0; i < 8; i++) {
+      unsigned irr   = Cpu::xchg(_pir + i, 0U);
+      unsigned deass = Cpu::xchg(_pir_deass + i, 0U);
+      if (irr) {
+	unsigned tmr = _pir_tmr[i] & irr;
+	if (tmr) Cpu::atomic_and(_pir_tmr + i, ~tmr);
+
+	Cpu::atomic_or (_vector + (OFS_TMR >> 5) + i, tmr);
+	Cpu::atomic_and(_vector + (OFS_TMR >> 5) + i, ~(irr & ~tmr));
+	Cpu::atomic_or (_vector + (OFS_IRR >> 5) + i, irr);
+      }
+      if (deass) Cpu::atomic_and(_vector + (OFS_IRR >> 5) + i, ~deass);
+    }
+
+    unsigned events = Cpu::xchg(&_posted, 0U);
+    if (events & POST_ERROR) set_error(6);
+    if (events & POST_LINT0) {
+      bool lint0 = _lint0;
+      _lvtds[_LINT0_offset - LVT_BASE] = lint0;
+      if (lint0 && !hw_disabled()) trigger_lvt(_LINT0_offset - LVT_BASE);
+    }
+    if (events & POST_NMI && !hw_disabled()) trigger_lvt(_LINT1_offset - LVT_BASE);
+    if (events & POST_TIMEOUT && !hw_disabled()) get_ccr(_mb.clock()->time());
+    update_irqs();
+  }
+
   /**
    * Broadcast an EOI on the bus if it is level triggered.
    */
@@ -356,6 +461,7 @@ private:
       value = processor_prio();
       break;
     case 0x10 ... 0x27:
+      fold_posted();
       value = _vector[offset - 0x10];
       break;
     case 0x39:
@@ -549,9 +655,22 @@ public:
   bool  receive(MessageTimeout &msg) {
     if (hw_disabled() || msg.nr != _timer) return false;
 
+    // the global timer thread is not our CPU
+    post_event(POST_TIMEOUT);
+    return true;
+  }
+
+
+  /**
+   * Receive a timeout of our timer on the thread of our CPU.
+   */
+  static bool receive_local_timeout(Device *dev, MessageTimeout &msg) {
+    Lapic *lapic = static_cast<Lapic *>(dev);
+    if (lapic->hw_disabled() || msg.nr != lapic->_timer) return false;
+
     // no need to call update timer here, as the CPU needs to do an
     // EOI first
-    get_ccr(_mb.clock()->time());
+    lapic->get_ccr(lapic->_mb.clock()->time());
     return true;
   }
 
@@ -567,8 +686,16 @@ public:
     assert(event != VCpu::EVENT_RRD);
     assert(event != VCpu::EVENT_LOWEST);
 
-    if (event == VCpu::EVENT_FIXED)
-      accept_vector(msg.icr, msg.icr & MessageApic::ICR_LEVEL, msg.icr & MessageApic::ICR_ASSERT);
+    bool level = msg.icr & MessageApic::ICR_LEVEL;
+    if (event == VCpu::EVENT_FIXED) {
+      // errors are left to our CPU
+      if ((msg.icr & 0xff) < 16)
+	post_event(POST_ERROR);
+      else if (level && ~msg.icr & MessageApic::ICR_ASSERT)
+	post_deassert(msg.icr);
+      else
+	post_vector(msg.icr, level);
+    }
     else {
       if (event == VCpu::EVENT_SIPI) event |= (msg.icr & 0xff) << 8;
 
@@ -584,6 +711,7 @@ public:
    */
   bool  receive(LapicEvent &msg) {
     if (!hw_disabled() && msg.type == LapicEvent::INTA) {
+      fold_posted();
       unsigned irrv = prioritize_irq();
 
       if (irrv & 0x100) {
@@ -604,6 +732,8 @@ public:
 	msg.value = _SVR & 0xff;
       update_irqs();
     }
+    else if (msg.type == LapicEvent::POSTED)
+      fold_posted();
     else if (msg.type == LapicEvent::RESET)
       reset();
     else if (msg.type == LapicEvent::INIT)
@@ -679,18 +809,15 @@ public:
    */
   bool  receive(MessageLegacy &msg) {
 
-    // the legacy PIC output is level triggered and wired to LINT0
-    if (msg.type == MessageLegacy::INTR) {
-      _lvtds[_LINT0_offset - LVT_BASE] = true;
-      if (!hw_disabled()) trigger_lvt(_LINT0_offset - LVT_BASE);
-    }
-    else if (msg.type == MessageLegacy::DEASS_INTR) {
-      _lvtds[_LINT0_offset - LVT_BASE] = false;
-      update_irqs();
+    // the legacy PIC output is level triggered and wired to LINT0,
+    // our CPU picks up the last level
+    if (msg.type == MessageLegacy::INTR || msg.type == MessageLegacy::DEASS_INTR) {
+      _lint0 = msg.type == MessageLegacy::INTR;
+      post_event(POST_LINT0);
     }
     // NMIs are received on LINT1
     else if (!hw_disabled() && msg.type == MessageLegacy::NMI)
-      return trigger_lvt(_LINT1_offset - LVT_BASE);
+      post_event(POST_NMI);
     else
       return false;
     return true;
@@ -739,7 +866,8 @@ public:
   }
 
 
-  Lapic(Motherboard &mb, VCpu *vcpu, unsigned initial_apic_id, unsigned timer) : _mb(mb), _vcpu(vcpu), _initial_apic_id(initial_apic_id), _timer(timer)
+  Lapic(Motherboard &mb, VCpu *vcpu, unsigned initial_apic_id, unsigned timer) : _mb(mb), _vcpu(vcpu), _initial_apic_id(initial_apic_id), _timer(timer),
+    _posted(0), _notified(0), _lint0(false)
   {
     // find a FREQ that is not too high
     for (_timer_clock_shift=0; _timer_clock_shift < 32; _timer_clock_shift++)
@@ -756,6 +884,7 @@ public:
     for (unsigned i=0; i < sizeof(msg) / sizeof(*msg); i++)
       _vcpu->executor.send(msg[i]);
 
+    _apic_slot = mb.apic_directory.add(this, receive_static<MessageApic>);
     reset();
 
     mb.bus_legacy.add(this,   receive_static<MessageLegacy>);
@@ -766,6 +895,7 @@ public:
     vcpu->mem.add(this,       receive_static<MessageMem>);
     vcpu->memregion.add(this, receive_static<MessageMemRegion>);
     vcpu->bus_lapic.add(this, receive_static<LapicEvent>);
+    vcpu->bus_timeout.add(this, receive_local_timeout);
 
   }
 };
@@ -778,8 +908,8 @@ PARAM_HANDLER(lapic,
 {
   if (!mb.last_vcpu) Logging::panic("no VCPU for this APIC");
 
-  // allocate a timer
-  MessageTimer msg0;
+  // allocate a timer that expires on our VCPU
+  MessageTimer msg0(mb.last_vcpu);
   if (!mb.bus_timer.send(msg0))
     Logging::panic("%s can't get a timer", __PRETTY_FUNCTION__);
 
@@ -792,11 +922,11 @@ PARAM_HANDLER(lapic,
 
 #else
 VMM_REGSET(Lapic,
-       VMM_REG_RW(_ID,            0x02,          0, 0xff000000,)
+       VMM_REG_RW(_ID,            0x02,          0, 0xff000000, update_directory();)
        VMM_REG_RO(_VERSION,       0x03, 0x01050014)
        VMM_REG_RW(_TPR,           0x08,          0, 0xff,)
-       VMM_REG_RW(_LDR,           0x0d,          0, 0xff000000,)
-       VMM_REG_RW(_DFR,           0x0e, 0xffffffff, 0xf0000000,)
+       VMM_REG_RW(_LDR,           0x0d,          0, 0xff000000, update_directory();)
+       VMM_REG_RW(_DFR,           0x0e, 0xffffffff, 0xf0000000, update_directory();)
        VMM_REG_RW(_SVR,           0x0f, 0x000000ff, 0x11ff,     update_irqs();)
        VMM_REG_RW(_ESR,           0x28,          0, 0xffffffff, _ESR = Cpu::xchg(&_esr_shadow, 0U); return !value; )
        VMM_REG_RW(_ICR,           0x30,          0, 0x000ccfff, if (!send_ipi(_ICR, _ICR1)) COUNTER_INC("IPI missed");)
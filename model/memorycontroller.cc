@@ -23,6 +23,10 @@ class MemoryController : public StaticReceiver<MemoryController>
   char *_physmem;
   uintptr_t _start;
   uintptr_t _end;
+  // write generation per page, see MessageMemRegion
+  unsigned *_gen;
+
+  uintptr_t pages() { return (_end - _start + 0xfff) >> 12; }
 
 
 public:
@@ -34,7 +38,12 @@ public:
     if ((msg.phys < _start) || (msg.phys >= (_end - 4)))  return false;
     unsigned *ptr = reinterpret_cast<unsigned *>(_physmem + msg.phys);
 
-    if (msg.read) *msg.ptr = *ptr; else *ptr = *msg.ptr;
+    if (msg.read) *msg.ptr = *ptr; else {
+      // the generations are incremented after the store, see MessageMemRegion
+      *ptr = *msg.ptr;
+      Cpu::atomic_xadd(_gen + ((msg.phys - _start) >> 12), 1);
+      if ((msg.phys ^ (msg.phys + 3)) & ~0xffful) Cpu::atomic_xadd(_gen + ((msg.phys + 3 - _start) >> 12), 1);
+    }
     return true;
   }
 
@@ -45,11 +54,24 @@ public:
     msg.start_page = _start >> 12;
     msg.count = (_end - _start) >> 12;
     msg.ptr = _physmem + _start;
+    msg.gen = _gen;
     return true;
   }
 
 
-  MemoryController(char *physmem, uintptr_t start, uintptr_t end) : _physmem(physmem), _start(start), _end(end) {}
+  /**
+   * The guest may load different code after a reset without us
+   * seeing the writes, thus invalidate all cached instructions.
+   */
+  bool  receive(MessageLegacy &msg)
+  {
+    if (msg.type == MessageLegacy::RESET)
+      for (uintptr_t i = 0; i < pages(); i++) Cpu::atomic_xadd(_gen + i, 1);
+    return false;
+  }
+
+
+  MemoryController(char *physmem, uintptr_t start, uintptr_t end) : _physmem(physmem), _start(start), _end(end), _gen(new unsigned[pages()]()) {}
 };
 
 
@@ -67,6 +89,7 @@ PARAM_HANDLER(mem,
   Logging::printf("physmem: %zx [%zx, %zx]\n", size_t(msg.value), start, end);
   MemoryController *dev = new MemoryController(msg.ptr, start, end);
   // physmem access
-  mb.bus_mem.add(dev,       MemoryController::receive_static<MessageMem>);
+  mb.bus_mem.add(dev,       MemoryController::receive_static<MessageMem>, start, end - start);
   mb.bus_memregion.add(dev, MemoryController::receive_static<MessageMemRegion>);
+  mb.bus_legacy.add(dev,    MemoryController::receive_static<MessageLegacy>);
 }
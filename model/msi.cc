@@ -18,6 +18,7 @@
 
 #include "nul/motherboard.h"
 #include "nul/vcpu.h"
+#include "model/apicroute.h"
 
 
 /**
@@ -27,7 +28,7 @@
  * Features: LowestPrio: RoundRobin, 16bit dest
  */
 class Msi  : public StaticReceiver<Msi> {
-  DBus<MessageApic>  & _bus_apic;
+  ApicDirectory & _apics;
   unsigned  _lowest_rr;
 
 public:
@@ -36,32 +37,15 @@ public:
 
     COUNTER_INC("MSI");
 
-    uintptr_t dst = (msg.phys >> 12) & 0xff | (msg.phys << 4) & 0xff00;
-    unsigned icr = *msg.ptr & 0xc7ff;
-    unsigned event = 1 << ((icr >> 8) & 7);
-
-    // do not forward RRD and SIPI
-    if (event & (VCpu::EVENT_RRD | VCpu::EVENT_SIPI)) return false;
-
-    // set logical destination mode
-    if (msg.phys & MessageMem::MSI_DM) icr |= MessageApic::ICR_DM;
-
-    // lowest prio mode?
-    if (msg.phys & MessageMem::MSI_RH || event & VCpu::EVENT_LOWEST) {
-      // we send them round-robin as EVENT_FIXED
-      MessageApic msg1(icr & ~0x700, dst, 0);
-      return _bus_apic.send_rr(msg1, _lowest_rr);
-    }
-    MessageApic msg1(icr, dst, 0);
-    return _bus_apic.send(msg1);
+    return ApicRoute(msg.phys, *msg.ptr).send(_apics, _lowest_rr);
   }
 
-  Msi(DBus<MessageApic>  &bus_apic) : _bus_apic(bus_apic), _lowest_rr() {}
+  Msi(ApicDirectory &apics) : _apics(apics), _lowest_rr() {}
 };
 
 PARAM_HANDLER(msi,
 	      "msi - provide MSI support by forwarding access to 0xfee00000 to the LocalAPICs.")
 {
-  mb.bus_mem.add(new Msi(mb.bus_apic), Msi::receive_static<MessageMem>);
+  mb.bus_mem.add(new Msi(mb.apic_directory), Msi::receive_static<MessageMem>, MessageMem::MSI_ADDRESS, 1 << 20);
 }
 
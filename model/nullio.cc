@@ -33,9 +33,9 @@ class NullIODevice : public StaticReceiver<NullIODevice>
 
  public:
   NullIODevice(unsigned base, unsigned size, unsigned value) : _base(base), _size(size), _value(value) {}
-  bool  receive(MessageIOOut &msg) { return in_range(msg.port, _base, _size); }
+  bool  receive(MessageIOOut &msg) { return !msg.count && in_range(msg.port, _base, _size); }
   bool  receive(MessageIOIn  &msg) {
-    if (!in_range(msg.port, _base, _size)) return false;
+    if (!in_range(msg.port, _base, _size) || msg.count) return false;
     if (_value != ~0U)  msg.value = _value;
     return true;
   }
@@ -47,7 +47,7 @@ PARAM_HANDLER(nullio,
 	      "Example: 'nullio:0x80+1'.")
 {
   NullIODevice *dev = new NullIODevice(argv[0], argv[1] == ~0UL ? 1 : argv[1], argv[2]);
-  mb.bus_ioin.add(dev,  NullIODevice::receive_static<MessageIOIn>);
-  mb.bus_ioout.add(dev, NullIODevice::receive_static<MessageIOOut>);
+  mb.bus_ioin.add(dev,  NullIODevice::receive_static<MessageIOIn>,  argv[0], argv[1] == ~0UL ? 1 : argv[1]);
+  mb.bus_ioout.add(dev, NullIODevice::receive_static<MessageIOOut>, argv[0], argv[1] == ~0UL ? 1 : argv[1]);
 }
 
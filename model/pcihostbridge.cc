@@ -58,6 +58,7 @@ public:
 
   bool receive(MessageIOIn &msg)
   {
+    if (msg.count) return false;
     bool res = true;
     if (msg.port == _iobase && msg.type == MessageIOIn::TYPE_INL)
       msg.value = _confaddress;
@@ -71,6 +72,8 @@ public:
 
   bool receive(MessageIOOut &msg)
   {
+    if (msg.count) return false;
+
     /**
      * According to
      * http://www.cs.helsinki.fi/linux/linux-kernel/2003-01/1126.html
@@ -245,13 +248,13 @@ PARAM_HANDLER(pcihostbridge,
 
   // ioport interface
   if (~argv[2]) {
-    mb.bus_ioin.add(dev,  PciHostBridge::receive_static<MessageIOIn>);
-    mb.bus_ioout.add(dev, PciHostBridge::receive_static<MessageIOOut>);
+    mb.bus_ioin.add(dev,  PciHostBridge::receive_static<MessageIOIn>,  argv[2], 8);
+    mb.bus_ioout.add(dev, PciHostBridge::receive_static<MessageIOOut>, argv[2], 8);
   }
 
   // MMCFG interface
   if (~argv[3]) {
-    mb.bus_mem.add(dev,       PciHostBridge::receive_static<MessageMem>);
+    mb.bus_mem.add(dev,       PciHostBridge::receive_static<MessageMem>, argv[3], argv[1] << 20);
     mb.bus_discovery.add(dev, PciHostBridge::discover);
   }
 
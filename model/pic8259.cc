@@ -222,7 +222,7 @@ class PicDevice : public StaticReceiver<PicDevice>
 
   bool  receive(MessageIOIn &msg)
   {
-    if (!in_range(msg.port, _base, 2) && msg.port != _elcr_base || msg.type != MessageIOIn::TYPE_INB)
+    if (!in_range(msg.port, _base, 2) && msg.port != _elcr_base || msg.type != MessageIOIn::TYPE_INB || msg.count)
       return false;
 
     if (msg.port == _elcr_base)
@@ -248,7 +248,7 @@ class PicDevice : public StaticReceiver<PicDevice>
    */
   bool  receive(MessageIOOut &msg)
   {
-      if (!in_range(msg.port, _base, 2) && msg.port != _elcr_base || msg.type != MessageIOOut::TYPE_OUTB)
+      if (!in_range(msg.port, _base, 2) && msg.port != _elcr_base || msg.type != MessageIOOut::TYPE_OUTB || msg.count)
 	return false;
 
       if (msg.port == _elcr_base)
@@ -380,8 +380,12 @@ PARAM_HANDLER(pic,
 				 argv[1],
 				 argv[2],
 				 virq);
-  mb.bus_ioin.    add(dev, PicDevice::receive_static<MessageIOIn>);
-  mb.bus_ioout.   add(dev, PicDevice::receive_static<MessageIOOut>);
+  mb.bus_ioin.    add(dev, PicDevice::receive_static<MessageIOIn>,  argv[0], 2);
+  mb.bus_ioout.   add(dev, PicDevice::receive_static<MessageIOOut>, argv[0], 2);
+  if (~argv[2]) {
+    mb.bus_ioin.  add(dev, PicDevice::receive_static<MessageIOIn>,  argv[2], 1);
+    mb.bus_ioout. add(dev, PicDevice::receive_static<MessageIOOut>, argv[2], 1);
+  }
   mb.bus_irqlines.add(dev, PicDevice::receive_static<MessageIrqLines>);
   mb.bus_pic.     add(dev, PicDevice::receive_static<MessagePic>);
   if (!virq)
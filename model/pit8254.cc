@@ -392,7 +392,7 @@ class PitDevice : public StaticReceiver<PitDevice>
 
  bool  receive(MessageIOIn &msg)
  {
-   if (!in_range(msg.port, _base, COUNTER) || msg.type != MessageIOIn::TYPE_INB)
+   if (!in_range(msg.port, _base, COUNTER) || msg.type != MessageIOIn::TYPE_INB || msg.count)
      return false;
    msg.value = _c[msg.port - _base].read();
    return true;
@@ -401,7 +401,7 @@ class PitDevice : public StaticReceiver<PitDevice>
 
  bool  receive(MessageIOOut &msg)
  {
-   if (!in_range(msg.port, _base, COUNTER+1) || msg.type != MessageIOOut::TYPE_OUTB)
+   if (!in_range(msg.port, _base, COUNTER+1) || msg.type != MessageIOOut::TYPE_OUTB || msg.count)
      return false;
    if (msg.port == _base + COUNTER)
      {
@@ -446,7 +446,7 @@ PARAM_HANDLER(pit,
 				 argv[1],
 				 pit_count++);
 
-  mb.bus_ioin.add(dev,  PitDevice::receive_static<MessageIOIn>);
-  mb.bus_ioout.add(dev, PitDevice::receive_static<MessageIOOut>);
+  mb.bus_ioin.add(dev,  PitDevice::receive_static<MessageIOIn>,  argv[0], 4);
+  mb.bus_ioout.add(dev, PitDevice::receive_static<MessageIOOut>, argv[0], 4);
   mb.bus_pit.add(dev,   PitDevice::receive_static<MessagePit>);
 } 
@@ -36,7 +36,7 @@ private:
 public:
   bool  receive(MessageIOIn &msg) {
 
-    if (msg.port != _iobase || msg.type != MessageIOIn::TYPE_INL)  return false;
+    if (msg.port != _iobase || msg.type != MessageIOIn::TYPE_INL || msg.count)  return false;
     msg.value = _mb.clock()->clock(FREQ);
     return true;
   }
@@ -54,7 +54,7 @@ public:
 
   PmTimer(Motherboard &mb, unsigned iobase) : _mb(mb), _iobase(iobase) {
 
-    _mb.bus_ioin.add(this,      receive_static<MessageIOIn>);
+    _mb.bus_ioin.add(this,      receive_static<MessageIOIn>, _iobase, 1);
     _mb.bus_discovery.add(this, discover);
   }
 };
@@ -275,8 +275,22 @@ class Rtl8029: public StaticReceiver<Rtl8029>
 public:
   bool  receive(MessageNetwork &msg)
   {
+    if (msg.type == MessageNetwork::PACKETS) {
+      for (unsigned i = 0; i < msg.packetcount; i++) {
+        MessageNetwork m = msg.packet(i);
+        receive(m);
+      }
+      return true;
+    }
+    if (msg.type != MessageNetwork::PACKET) return false;
+
     if (msg.buffer >= _mem && msg.buffer < _mem + sizeof(_mem)) return false;
-    return receive_packet(msg.buffer, msg.len);
+    if (msg.buffer) return receive_packet(msg.buffer, msg.len);
+
+    // the frames are small, thus we linearize fragmented packets
+    unsigned char buf[2048];
+    if (msg.len > sizeof(buf)) return false;
+    return receive_packet(buf, msg.copy(buf, sizeof(buf)));
   }
 
   bool receive(MessageIOIn &msg)
@@ -285,6 +299,19 @@ public:
     if (!match_bar(addr) || !(PCI_CMD_STS & 0x1))
       return false;
 
+    // a block from the remote DMA port
+    if (msg.count) {
+      if (addr < 0x10 || addr + (1u<<msg.type) > 0x18) return false;
+      unsigned char *p = reinterpret_cast<unsigned char *>(msg.ptr);
+      for (; msg.count; msg.count--)
+	for (unsigned i = 0; i < (1u<<msg.type); i++) {
+	  *p = 0xff;
+	  read_byte(addr, p++);
+	}
+      msg.ptr = p;
+      return true;
+    }
+
     // for every byte
     for (unsigned i = 0; i < (1u<<msg.type); i++, addr++)
       read_byte(addr, reinterpret_cast<unsigned char *>(&msg.value)+i);
@@ -299,6 +326,16 @@ public:
     if (!match_bar(addr) || !(PCI_CMD_STS & 0x1))
       return false;
 
+    if (msg.count) {
+      if (addr < 0x10 || addr + (1u<<msg.type) > 0x18) return false;
+      unsigned char *p = reinterpret_cast<unsigned char *>(msg.ptr);
+      for (; msg.count; msg.count--)
+	for (unsigned i = 0; i < (1u<<msg.type); i++)
+	  write_byte(addr, *p++);
+      msg.ptr = p;
+      return true;
+    }
+
     for (unsigned i = 0; i < (1u<<msg.type); i++, addr++)
       write_byte(addr, msg.value >> (i*8));
     return true;
@@ -121,7 +121,7 @@ public:
 
   bool  receive(MessageIOIn &msg)
   {
-    if (!in_range(msg.port, _base, 8) || msg.type != MessageIOIn::TYPE_INB)
+    if (!in_range(msg.port, _base, 8) || msg.type != MessageIOIn::TYPE_INB || msg.count)
       return false;
     unsigned offset = msg.port - _base;
     if (_regs[LCR] & 0x80 && offset <= IER)
@@ -162,7 +162,7 @@ public:
 
   bool  receive(MessageIOOut &msg)
   {
-    if (!in_range(msg.port, _base, 8) || msg.type != MessageIOOut::TYPE_OUTB)
+    if (!in_range(msg.port, _base, 8) || msg.type != MessageIOOut::TYPE_OUTB || msg.count)
       return false;
 
     msg.value &= 0xff;
@@ -254,8 +254,8 @@ public:
       memset(_regs, 0, sizeof(_regs));
       _regs[LSR] = 0x60;
       _regs[MSR] = 0xb0;
-      _mb.bus_ioin.     add(this, receive_static<MessageIOIn>);
-      _mb.bus_ioout.    add(this, receive_static<MessageIOOut>);
+      _mb.bus_ioin.     add(this, receive_static<MessageIOIn>,  _base, 8);
+      _mb.bus_ioout.    add(this, receive_static<MessageIOOut>, _base, 8);
       _mb.bus_serial.   add(this, receive_static<MessageSerial>);
       _mb.bus_discovery.add(this, discover);
     }
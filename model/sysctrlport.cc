@@ -39,7 +39,7 @@ class SystemControlPort : public StaticReceiver<SystemControlPort>
 
   bool  receive(MessageIOIn &msg)
   {
-    if (msg.type != MessageIOIn::TYPE_INB) return false;
+    if (msg.type != MessageIOIn::TYPE_INB || msg.count) return false;
     if (msg.port == _port_a)
       {
 	msg.value = _last_porta & 0x3;
@@ -64,7 +64,7 @@ class SystemControlPort : public StaticReceiver<SystemControlPort>
 
   bool  receive(MessageIOOut &msg)
   {
-    if (msg.type != MessageIOOut::TYPE_OUTB) return false;
+    if (msg.type != MessageIOOut::TYPE_OUTB || msg.count) return false;
     if (msg.port == _port_a)
       {
 	// fast A20 gate
@@ -102,6 +102,8 @@ PARAM_HANDLER(scp,
 	      "Example: 'scp:0x92,0x61'")
 {
   SystemControlPort *scp = new SystemControlPort(mb.bus_legacy, mb.bus_pit, argv[0], argv[1]);
-  mb.bus_ioin.add(scp,  SystemControlPort::receive_static<MessageIOIn>);
-  mb.bus_ioout.add(scp, SystemControlPort::receive_static<MessageIOOut>);
+  for (unsigned i = 0; i < 2; i++) {
+    mb.bus_ioin.add(scp,  SystemControlPort::receive_static<MessageIOIn>,  argv[i], 1);
+    mb.bus_ioout.add(scp, SystemControlPort::receive_static<MessageIOOut>, argv[i], 1);
+  }
 }
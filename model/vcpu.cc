@@ -196,6 +196,15 @@ class VirtualCpu : public VCpu, public StaticReceiver<VirtualCpu>
    */
   void prioritize_events(CpuMessage &msg) {
     CpuState *cpu = msg.cpu;
+
+    // let the LAPIC handle the events that were posted to it before
+    // we look at the INTR line
+    if (_event & EVENT_POSTED) {
+      Cpu::atomic_and<volatile unsigned>(&_event, ~EVENT_POSTED);
+      LapicEvent msg2(LapicEvent::POSTED);
+      bus_lapic.send(msg2, true);
+    }
+
     unsigned old_event = _event;
 
     assert(msg.mtr_in & MTD_STATE);
@@ -283,7 +292,42 @@ class VirtualCpu : public VCpu, public StaticReceiver<VirtualCpu>
     cpu->actv_state = 0;
   }
 
+  /**
+   * A rep ins or outs.  A device may transfer the whole block at
+   * once, the rest is done element by element.
+   */
+  void handle_io_block(CpuMessage &msg) {
+    unsigned size = 1 << msg.io_order;
+    char *ptr;
+    unsigned count;
+    if (msg.type == CpuMessage::TYPE_IOIN) {
+      MessageIOIn msg2(MessageIOIn::Type(msg.io_order), msg.port, msg.io_count, msg.dst);
+      _mb.bus_ioin.send(msg2, true);
+      ptr   = reinterpret_cast<char *>(msg2.ptr);
+      count = msg2.count;
+    } else {
+      MessageIOOut msg2(MessageIOOut::Type(msg.io_order), msg.port, msg.io_count, msg.dst);
+      _mb.bus_ioout.send(msg2, true);
+      ptr   = reinterpret_cast<char *>(msg2.ptr);
+      count = msg2.count;
+    }
+
+    for (; count; count--, ptr += size)
+      if (msg.type == CpuMessage::TYPE_IOIN) {
+	MessageIOIn msg2(MessageIOIn::Type(msg.io_order), msg.port);
+	_mb.bus_ioin.send(msg2);
+	Cpu::move(ptr, &msg2.value, msg.io_order);
+      } else {
+	MessageIOOut msg2(MessageIOOut::Type(msg.io_order), msg.port, 0);
+	Cpu::move(&msg2.value, ptr, msg.io_order);
+	_mb.bus_ioout.send(msg2);
+      }
+    msg.consumed = 1;
+  }
+
+
   void handle_ioin(CpuMessage &msg) {
+    if (msg.io_count) return handle_io_block(msg);
     MessageIOIn msg2(MessageIOIn::Type(msg.io_order), msg.port);
     bool res = _mb.bus_ioin.send(msg2);
 
@@ -298,6 +342,7 @@ class VirtualCpu : public VCpu, public StaticReceiver<VirtualCpu>
 
 
   void handle_ioout(CpuMessage &msg) {
+    if (msg.io_count) return handle_io_block(msg);
     MessageIOOut msg2(MessageIOOut::Type(msg.io_order), msg.port, 0);
     Cpu::move(&msg2.value, msg.dst, msg.io_order);
 
@@ -316,7 +361,7 @@ class VirtualCpu : public VCpu, public StaticReceiver<VirtualCpu>
     COUNTER_INC("EVENT");
 
     if (value & DEASS_INTR) Cpu::atomic_and<volatile unsigned>(&_event, ~EVENT_INTR);
-    if (!((~_event & value) & (EVENT_MASK | EVENT_DEBUG | EVENT_HOST))) return;
+    if (!((~_event & value) & (EVENT_MASK | EVENT_DEBUG | EVENT_HOST | EVENT_POSTED))) return;
 
     // INIT or AP RESET - go to the wait-for-sipi state
     if ((value & EVENT_MASK) == EVENT_INIT)
@@ -331,7 +376,7 @@ class VirtualCpu : public VCpu, public StaticReceiver<VirtualCpu>
        */
       if (Cpu::cmpxchg4b(&_sipi, 0, value)) return;
 
-    Cpu::atomic_or<volatile unsigned>(&_event, STATE_WAKEUP | (value & (EVENT_MASK | EVENT_DEBUG | EVENT_HOST)));
+    Cpu::atomic_or<volatile unsigned>(&_event, STATE_WAKEUP | (value & (EVENT_MASK | EVENT_DEBUG | EVENT_HOST | EVENT_POSTED)));
 
 
     MessageHostOp msg(MessageHostOp::OP_VCPU_RELEASE, _hostop_id, _event & STATE_BLOCK);
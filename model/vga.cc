@@ -365,6 +365,7 @@ public:
 
   bool  receive(MessageIOOut &msg)
   {
+    if (msg.count) return false;
     bool res = false;
     for (unsigned i = 0; i < (1u << msg.type); i++)
       {
@@ -420,6 +421,7 @@ public:
 
   bool  receive(MessageIOIn &msg)
   {
+    if (msg.count) return false;
     bool res = false;;
     for (unsigned i = 0; i < (1u << msg.type); i++)
       {
@@ -570,10 +572,12 @@ PARAM_HANDLER(vga,
     Logging::panic("%s failed to alloc %zd from guest memory\n", __PRETTY_FUNCTION__, fbsize);
 
   Vga *dev = new Vga(mb, argv[0], msg2.ptr + msg.phys, msg.phys, fbsize);
-  mb.bus_ioin     .add(dev, Vga::receive_static<MessageIOIn>);
-  mb.bus_ioout    .add(dev, Vga::receive_static<MessageIOOut>);
+  // multi-byte accesses are split, thus they may start below iobase
+  mb.bus_ioin     .add(dev, Vga::receive_static<MessageIOIn>,  argv[0] - 3, 32 + 3);
+  mb.bus_ioout    .add(dev, Vga::receive_static<MessageIOOut>, argv[0] - 3, 32 + 3);
   mb.bus_bios     .add(dev, Vga::receive_static<MessageBios>);
-  mb.bus_mem      .add(dev, Vga::receive_static<MessageMem>);
+  mb.bus_mem      .add(dev, Vga::receive_static<MessageMem>, 0xa0000, 1 << 17);
+  mb.bus_mem      .add(dev, Vga::receive_static<MessageMem>, msg.phys, fbsize);
   mb.bus_memregion.add(dev, Vga::receive_static<MessageMemRegion>);
   mb.bus_discovery.add(dev, Vga::receive_static<MessageDiscovery>);
 }
@@ -393,8 +393,23 @@ bool Vancouver::receive(MessageNetwork &msg) {
             if(addr >= _netsess->inbuf().virt() &&
                     addr + msg.len <= _netsess->inbuf().virt() + _netsess->inbuf().size())
                 return false;
+            if(!msg.buffer) {
+                // the network session needs the packet in one piece. the busses are
+                // serialized by globalsm, so a static buffer is fine.
+                static unsigned char packet[64 * 1024];
+                if(msg.len > sizeof(packet))
+                    return false;
+                return _netsess->send(packet, msg.copy(packet, sizeof(packet)));
+            }
             return _netsess->send(msg.buffer, msg.len);
         }
+        case MessageNetwork::PACKETS: {
+            for(unsigned i = 0; i < msg.packetcount; i++) {
+                MessageNetwork m = msg.packet(i);
+                receive(m);
+            }
+            return true;
+        }
         case MessageNetwork::QUERY_MAC: {
             Network::NIC info = _netsess->get_info();
             msg.mac = info.mac.raw();
@@ -0,0 +1,421 @@
+/**
+ * UNIX Seoul frontend: disk images
+ *
+ * This file is part of Seoul.
+ *
+ * Seoul is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * Seoul is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License version 2 for more details.
+ */
+
+#include <service/logging.h>
+#include <service/cpu.h>
+#include <seoul/disk.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/stat.h>
+
+static const char overlay_magic[8] = { 'S', 'E', 'O', 'U', 'L', 'C', 'O', 'W' };
+
+/**
+ * Transfer an iovec list, continuing after short transfers and at the
+ * IOV_MAX limit.  The list is modified.  Reading at the end of the
+ * file returns zeros, as the size of an image is rounded up to whole
+ * sectors.
+ */
+static bool fd_rw(int fd, bool read, struct iovec *iov, unsigned count, off_t offset)
+{
+  while (count) {
+    ssize_t bytes = (read ? preadv : pwritev)(fd, iov, count < IOV_MAX ? count : IOV_MAX, offset);
+    if (bytes < 0 or (bytes == 0 and not read)) return false;
+    if (bytes == 0) {
+      for (; count; iov++, count--) memset(iov->iov_base, 0, iov->iov_len);
+      break;
+    }
+
+    offset += bytes;
+    for (; count and size_t(bytes) >= iov->iov_len; iov++, count--)
+      bytes -= iov->iov_len;
+    if (count) {
+      iov->iov_base = static_cast<char *>(iov->iov_base) + bytes;
+      iov->iov_len -= bytes;
+    }
+  }
+  return true;
+}
+
+/**
+ * Get the part [offset, offset+length) of an iovec list.
+ */
+static void iov_slice(std::vector<struct iovec> &iov, size_t offset, size_t length,
+                      std::vector<struct iovec> &out)
+{
+  out.clear();
+  for (struct iovec &v : iov) {
+    if (!length) break;
+    if (offset >= v.iov_len) { offset -= v.iov_len; continue; }
+
+    size_t n = v.iov_len - offset < length ? v.iov_len - offset : length;
+    out.push_back({ static_cast<char *>(v.iov_base) + offset, n });
+    length -= n;
+    offset  = 0;
+  }
+}
+
+/**
+ * Copy between a buffer and the part [offset, offset+length) of an
+ * iovec list.
+ */
+static void iov_copy(std::vector<struct iovec> &iov, size_t offset, char *buf, size_t length, bool to_iov)
+{
+  for (struct iovec &v : iov) {
+    if (!length) break;
+    if (offset >= v.iov_len) { offset -= v.iov_len; continue; }
+
+    char  *p = static_cast<char *>(v.iov_base) + offset;
+    size_t n = v.iov_len - offset < length ? v.iov_len - offset : length;
+    if (to_iov) memcpy(p, buf, n); else memcpy(buf, p, n);
+    buf    += n;
+    length -= n;
+    offset  = 0;
+  }
+}
+
+
+bool Disk::overlay_copy(size_t block, std::vector<struct iovec> &iov, size_t iov_offset,
+                        off_t offset, size_t length)
+{
+  std::vector<struct iovec> slice;
+  iov_slice(iov, iov_offset, length, slice);
+
+  pthread_mutex_lock(&_cow_mtx);
+  if (in_overlay(block)) {
+    pthread_mutex_unlock(&_cow_mtx);
+    return fd_rw(_overlay_fd, false, slice.data(), slice.size(), _overlay_data + offset);
+  }
+
+  // Merge the new data with the old block, which may be beyond the
+  // end of the base image.
+  char buf[OVERLAY_BLOCK];
+  memset(buf, 0, sizeof(buf));
+  if (0 > pread(_fd, buf, sizeof(buf), off_t(block) * OVERLAY_BLOCK)) {
+    pthread_mutex_unlock(&_cow_mtx);
+    return false;
+  }
+  char *dst = buf + (offset - off_t(block) * OVERLAY_BLOCK);
+  for (struct iovec &v : slice) {
+    memcpy(dst, v.iov_base, v.iov_len);
+    dst += v.iov_len;
+  }
+
+  // The data has to be on disk before the bitmap, otherwise the block
+  // would be garbage after a crash.
+  bool res = sizeof(buf) == pwrite(_overlay_fd, buf, sizeof(buf), _overlay_data + off_t(block) * OVERLAY_BLOCK)
+    and 0 == fdatasync(_overlay_fd);
+  if (res) {
+    Cpu::atomic_set_bit(_bitmap, block);
+    res = sizeof(unsigned) == pwrite(_overlay_fd, _bitmap + block / 32, sizeof(unsigned),
+                                     OVERLAY_BLOCK + (block / 32) * sizeof(unsigned));
+  }
+  pthread_mutex_unlock(&_cow_mtx);
+  return res;
+}
+
+
+bool Disk::overlay_rw(bool read, std::vector<struct iovec> &iov, off_t offset, size_t length)
+{
+  std::vector<struct iovec> slice;
+
+  for (size_t pos = 0; pos < length;) {
+    // find a run of blocks that are all in the overlay or in the base image
+    size_t block   = (offset + pos) / OVERLAY_BLOCK;
+    bool   present = in_overlay(block);
+    size_t end     = (block + 1) * OVERLAY_BLOCK - offset;
+    while (end < length and in_overlay((offset + end) / OVERLAY_BLOCK) == present)
+      end += OVERLAY_BLOCK;
+    if (end > length) end = length;
+
+    if (!read and !present) {
+      for (size_t p = pos; p < end;) {
+        size_t b = (offset + p) / OVERLAY_BLOCK;
+        size_t n = ((b + 1) * OVERLAY_BLOCK - offset < end ? (b + 1) * OVERLAY_BLOCK - offset : end) - p;
+        if (!overlay_copy(b, iov, p, offset + p, n)) return false;
+        p += n;
+      }
+    } else {
+      iov_slice(iov, pos, end - pos, slice);
+      if (!fd_rw(present ? _overlay_fd : _fd, read, slice.data(), slice.size(),
+                 (present ? _overlay_data : 0) + offset + pos))
+        return false;
+    }
+    pos = end;
+  }
+  return true;
+}
+
+
+bool Disk::raw_rw(bool read, std::vector<struct iovec> &iov, off_t offset, size_t length)
+{
+  if (_overlay_fd < 0)
+    return fd_rw(_fd, read, iov.data(), iov.size(), offset);
+  return overlay_rw(read, iov, offset, length);
+}
+
+
+/**
+ * Find a chunk and make it the newest one.  Needs the cache lock.
+ */
+Disk::Chunk *Disk::cache_lookup(off_t offset)
+{
+  auto it = _cache.find(offset);
+  if (it == _cache.end()) return nullptr;
+
+  Chunk *c = it->second;
+  if (c != _newest) {
+    c->newer->older = c->older;
+    if (c->older) c->older->newer = c->newer; else _oldest = c->newer;
+    c->older        = _newest;
+    c->newer        = nullptr;
+    _newest->newer  = c;
+    _newest         = c;
+  }
+  return c;
+}
+
+
+/**
+ * Insert a chunk and take ownership of the data.  Needs the cache lock.
+ */
+void Disk::cache_insert(off_t offset, char *data)
+{
+  if (_cache.count(offset)) { delete [] data; return; }
+
+  Chunk *c;
+  if (_cache.size() < _cache_chunks)
+    c = new Chunk();
+  else {
+    // evict the oldest chunk
+    c = _oldest;
+    _cache.erase(c->offset);
+    _oldest = c->newer;
+    if (_oldest) _oldest->older = nullptr; else _newest = nullptr;
+    delete [] c->data;
+  }
+
+  c->offset = offset;
+  c->data   = data;
+  c->newer  = nullptr;
+  c->older  = _newest;
+  if (_newest) _newest->newer = c; else _oldest = c;
+  _newest   = c;
+  _cache[offset] = c;
+}
+
+
+/**
+ * Remove a chunk and free it.  Needs the cache lock.
+ */
+void Disk::cache_remove(Chunk *c)
+{
+  _cache.erase(c->offset);
+  if (c->newer) c->newer->older = c->older; else _newest = c->older;
+  if (c->older) c->older->newer = c->newer; else _oldest = c->newer;
+  delete [] c->data;
+  delete c;
+}
+
+
+bool Disk::cached_read(std::vector<struct iovec> &iov, off_t offset, size_t length)
+{
+  pthread_mutex_lock(&_cache_mtx);
+  _readahead = (offset == _next_read) ? (2 * _readahead < MAX_READAHEAD ? 2 * _readahead : unsigned(MAX_READAHEAD)) : 1;
+  _next_read = offset + length;
+
+  for (size_t pos = 0; pos < length;) {
+    off_t  chunk = (offset + pos) & ~off_t(CHUNK_SIZE - 1);
+    size_t n     = (chunk + CHUNK_SIZE < off_t(offset + length) ? chunk + CHUNK_SIZE : offset + length) - (offset + pos);
+
+    Chunk *c = cache_lookup(chunk);
+    if (c) {
+      hits++;
+      iov_copy(iov, pos, c->data + (offset + pos - chunk), n, true);
+      pos += n;
+      continue;
+    }
+    misses++;
+
+    // Fetch the missing chunks of the request and the read-ahead
+    // window with a single call and without holding the lock.
+    unsigned count = 1;
+    off_t    last  = (offset + length - 1) & ~off_t(CHUNK_SIZE - 1);
+    while (count < MAX_READAHEAD and
+           (chunk + off_t(count) * CHUNK_SIZE <= last or count < _readahead) and
+           chunk + off_t(count) * CHUNK_SIZE < off_t(size) and
+           !_cache.count(chunk + off_t(count) * CHUNK_SIZE))
+      count++;
+    unsigned long gen = _write_gen;
+    pthread_mutex_unlock(&_cache_mtx);
+
+    std::vector<struct iovec> fill;
+    size_t fill_length = 0;
+    for (unsigned i = 0; i < count; i++) {
+      size_t len = size - (chunk + i * CHUNK_SIZE) < CHUNK_SIZE ? size - (chunk + i * CHUNK_SIZE) : size_t(CHUNK_SIZE);
+      fill.push_back({ new char[CHUNK_SIZE](), len });
+      fill_length += len;
+    }
+    std::vector<struct iovec> data(fill);
+    if (!raw_rw(true, fill, chunk, fill_length)) {
+      for (struct iovec &v : data) delete [] static_cast<char *>(v.iov_base);
+
+      // do the rest uncached
+      std::vector<struct iovec> slice;
+      iov_slice(iov, pos, length - pos, slice);
+      return raw_rw(true, slice, offset + pos, length - pos);
+    }
+
+    pthread_mutex_lock(&_cache_mtx);
+    for (unsigned i = 0; i < count; i++) {
+      off_t start = chunk + off_t(i) * CHUNK_SIZE;
+      if (start < off_t(offset + length)) {
+        n = (start + CHUNK_SIZE < off_t(offset + length) ? start + CHUNK_SIZE : offset + length) - (offset + pos);
+        iov_copy(iov, pos, static_cast<char *>(data[i].iov_base) + (offset + pos - start), n, true);
+        pos += n;
+      } else
+        readaheads++;
+
+      // a concurrent write may have made the data stale
+      if (gen == _write_gen)
+        cache_insert(start, static_cast<char *>(data[i].iov_base));
+      else
+        delete [] static_cast<char *>(data[i].iov_base);
+    }
+  }
+  pthread_mutex_unlock(&_cache_mtx);
+  return true;
+}
+
+
+/**
+ * Update the cached chunks with the data of a write.
+ */
+void Disk::cached_write(std::vector<struct iovec> &iov, off_t offset, size_t length, bool written)
+{
+  pthread_mutex_lock(&_cache_mtx);
+  _write_gen++;
+  for (size_t pos = 0; pos < length;) {
+    off_t  chunk = (offset + pos) & ~off_t(CHUNK_SIZE - 1);
+    size_t n     = (chunk + CHUNK_SIZE < off_t(offset + length) ? chunk + CHUNK_SIZE : offset + length) - (offset + pos);
+
+    // A failed write may have changed parts of the disk, thus we
+    // drop the chunks instead.
+    auto it = _cache.find(chunk);
+    if (it != _cache.end()) {
+      if (written)
+        iov_copy(iov, pos, it->second->data + (offset + pos - chunk), n, false);
+      else
+        cache_remove(it->second);
+    }
+    pos += n;
+  }
+  pthread_mutex_unlock(&_cache_mtx);
+}
+
+
+bool Disk::rw(bool read, std::vector<struct iovec> &iov, off_t offset, size_t length)
+{
+  if (!_cache_chunks)
+    return raw_rw(read, iov, offset, length);
+  if (read)
+    return cached_read(iov, offset, length);
+
+  // The iovec list is modified by the transfer.
+  std::vector<struct iovec> data(iov);
+  bool res = raw_rw(false, iov, offset, length);
+  cached_write(data, offset, length, res);
+  return res;
+}
+
+
+bool Disk::flush()
+{
+  return 0 == fdatasync(_overlay_fd < 0 ? _fd : _overlay_fd);
+}
+
+
+void Disk::open_overlay(const char *filename)
+{
+  struct stat   st;
+  OverlayHeader header;
+  size_t        words = ((size + OVERLAY_BLOCK - 1) / OVERLAY_BLOCK + 31) / 32;
+
+  if (0 > (_overlay_fd = open(filename, O_RDWR | O_CREAT, 0644)) or
+      0 != fstat(_overlay_fd, &st)) {
+    perror("open overlay"); exit(EXIT_FAILURE);
+  }
+
+  _bitmap       = new unsigned[words]();
+  _overlay_data = (OVERLAY_BLOCK + words * sizeof(unsigned) + OVERLAY_BLOCK - 1) & ~(OVERLAY_BLOCK - 1);
+  pthread_mutex_init(&_cow_mtx, nullptr);
+
+  if (!st.st_size) {
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, overlay_magic, sizeof(header.magic));
+    header.version    = OVERLAY_VERSION;
+    header.block_size = OVERLAY_BLOCK;
+    header.size       = size;
+    if (sizeof(header) != pwrite(_overlay_fd, &header, sizeof(header), 0)) {
+      perror("write overlay"); exit(EXIT_FAILURE);
+    }
+    return;
+  }
+
+  if (sizeof(header) != pread(_overlay_fd, &header, sizeof(header), 0) or
+      memcmp(header.magic, overlay_magic, sizeof(header.magic)) or
+      header.version != OVERLAY_VERSION or header.block_size != OVERLAY_BLOCK or
+      header.size != size) {
+    fprintf(stderr, "%s is not an overlay for %s.\n", filename, name);
+    exit(EXIT_FAILURE);
+  }
+
+  // A new overlay has no bitmap yet, which reads as zeros.
+  if (0 > pread(_overlay_fd, _bitmap, words * sizeof(unsigned), OVERLAY_BLOCK)) {
+    perror("read overlay"); exit(EXIT_FAILURE);
+  }
+}
+
+
+Disk *Disk::from_file(const char *filename, const char *overlay, size_t cache_size)
+{
+  Disk *d = new Disk();
+  struct stat st;
+
+  d->name = filename;
+  if (0  > (d->_fd = open(filename, overlay ? O_RDONLY : O_RDWR)) or
+      0 != fstat(d->_fd, &st)) {
+    perror("open disk"); exit(EXIT_FAILURE);
+  }
+
+  d->size = (st.st_size + 511) & ~511; // Round to sector size
+
+  d->_cache_chunks = cache_size / CHUNK_SIZE;
+  pthread_mutex_init(&d->_cache_mtx, nullptr);
+
+  if (overlay) {
+    d->open_overlay(overlay);
+    printf("Added '%s' (%zu bytes) with overlay '%s' as disk.\n", filename, d->size, overlay);
+  } else
+    printf("Added '%s' (%zu bytes) as disk.\n", filename, d->size);
+  return d;
+}
+
+// EOF
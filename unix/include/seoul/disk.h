@@ -0,0 +1,120 @@
+/** -*- Mode: C++ -*-
+ * UNIX Seoul frontend: disk images
+ *
+ * This file is part of Seoul.
+ *
+ * Seoul is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * Seoul is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License version 2 for more details.
+ */
+
+#pragma once
+
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include <vector>
+#include <unordered_map>
+
+/**
+ * A disk image.
+ *
+ * If an overlay is given, the image is opened read-only and all
+ * writes go to the overlay file instead.  The overlay is a sparse file
+ * with a header, a bitmap of the blocks that were written and the
+ * data of these blocks.  Many VMs can thus share one base image.
+ *
+ * Reads go through an LRU cache of aligned chunks, which reads ahead
+ * on sequential access.  Writes are written through to the file.
+ */
+class Disk
+{
+  enum {
+    OVERLAY_BLOCK = 4096,
+    OVERLAY_VERSION = 1,
+    CHUNK_SIZE = 64 << 10,
+    MAX_READAHEAD = 8,
+  };
+
+  struct Chunk {
+    off_t  offset;
+    char  *data;
+    Chunk *newer;
+    Chunk *older;
+  };
+
+  struct OverlayHeader {
+    char               magic[8];
+    unsigned           version;
+    unsigned           block_size;
+    unsigned long long size;
+  };
+
+  int              _fd;
+  int              _overlay_fd;
+  unsigned        *_bitmap;
+  off_t            _overlay_data;
+  pthread_mutex_t  _cow_mtx;
+
+  // the block cache
+  std::unordered_map<off_t, Chunk *> _cache;
+  unsigned         _cache_chunks;
+  Chunk           *_newest;
+  Chunk           *_oldest;
+  pthread_mutex_t  _cache_mtx;
+  unsigned long    _write_gen;
+  off_t            _next_read;
+  unsigned         _readahead;
+
+  bool in_overlay(size_t block)
+  {
+    return __atomic_load_n(&_bitmap[block / 32], __ATOMIC_ACQUIRE) & (1U << (block % 32));
+  }
+
+  bool overlay_copy(size_t block, std::vector<struct iovec> &iov, size_t iov_offset, off_t offset, size_t length);
+  bool overlay_rw(bool read, std::vector<struct iovec> &iov, off_t offset, size_t length);
+  void open_overlay(const char *filename);
+  bool raw_rw(bool read, std::vector<struct iovec> &iov, off_t offset, size_t length);
+
+  Chunk *cache_lookup(off_t offset);
+  void   cache_insert(off_t offset, char *data);
+  void   cache_remove(Chunk *c);
+  bool   cached_read(std::vector<struct iovec> &iov, off_t offset, size_t length);
+  void   cached_write(std::vector<struct iovec> &iov, off_t offset, size_t length, bool written);
+
+  Disk() : _fd(-1), _overlay_fd(-1), _bitmap(nullptr), _overlay_data(0), _cow_mtx(),
+           _cache(), _cache_chunks(0), _newest(nullptr), _oldest(nullptr), _cache_mtx(),
+           _write_gen(0), _next_read(0), _readahead(1),
+           name(nullptr), size(0), hits(0), misses(0), readaheads(0) {}
+
+public:
+  const char *name;
+  size_t      size;
+
+  // block cache statistics in chunks
+  unsigned long hits;
+  unsigned long misses;
+  unsigned long readaheads;
+
+  /**
+   * Transfer length bytes at offset from or to the iovec list.
+   * Returns false on I/O errors and short transfers.
+   */
+  bool rw(bool read, std::vector<struct iovec> &iov, off_t offset, size_t length);
+
+  bool flush();
+
+  /**
+   * Open a disk image.  The cache is cache_size bytes large, zero
+   * disables it.
+   */
+  static Disk *from_file(const char *filename, const char *overlay, size_t cache_size);
+};
+
+// EOF
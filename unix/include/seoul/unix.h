@@ -19,9 +19,31 @@
 #pragma once
 
 #include <pthread.h>
+#include <nul/bus.h>
 
-// Serialize access for devices. Currently also used to serialize
-// everything else.
-extern pthread_mutex_t irq_mtx;
+/**
+ * A recursive mutex that can be attached to busses.
+ */
+class RecursiveLock : public DBusLock
+{
+  pthread_mutex_t _mtx;
+
+public:
+  void lock()   { pthread_mutex_lock(&_mtx);   }
+  void unlock() { pthread_mutex_unlock(&_mtx); }
+
+  RecursiveLock()
+  {
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+    pthread_mutex_init(&_mtx, &attr);
+    pthread_mutexattr_destroy(&attr);
+  }
+};
+
+// Serializes the device models. Virtual CPUs only take it, when they
+// leave the CPU-local state, e.g. for port I/O or MMIO.
+extern RecursiveLock device_lock;
 
 // EOF
@@ -23,6 +23,7 @@
 #include <stdio.h>
 #include <stdarg.h>
 #include <unistd.h>
+#include <pthread.h>
 
 class LoggingView : public StaticReceiver<LoggingView> {
 
@@ -77,7 +78,10 @@ public:
 
 };
 
-static LoggingView *view;
+static LoggingView    *view;
+
+// Virtual CPUs log concurrently.
+static pthread_mutex_t log_mtx = PTHREAD_MUTEX_INITIALIZER;
 
 void Logging::panic(const char *format, ...)
 {
@@ -106,10 +110,12 @@ void Logging::printf(const char *format, ...)
 
 void Logging::vprintf(const char *format, va_list &ap)
 {
+  pthread_mutex_lock(&log_mtx);
   if (view)
     view->vprintf(format, ap);
   else
     ::vfprintf(stderr, format, ap);
+  pthread_mutex_unlock(&log_mtx);
 }
 
 PARAM_HANDLER(logging,
@@ -36,18 +36,26 @@
 #include <sys/time.h>
 #include <sys/types.h>
 #include <sys/stat.h>
-#include <sys/select.h>
+#include <sys/epoll.h>
+#include <sys/uio.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+#include <poll.h>
+#include <sched.h>
 #include <time.h>
 #include <signal.h>
 #include <fcntl.h>
 #include <errno.h>
 
 #include <pthread.h>
-#include <semaphore.h>
 
 #include <vector>
+#include <deque>
 
 #include <seoul/unix.h>
+#include <seoul/disk.h>
 
 const char version_str[] =
 #include "version.inc"
@@ -57,6 +65,9 @@ const char version_str[] =
 
 static char  *ram;
 static size_t ram_size = 128 << 20; // 128 MB
+static const char *ram_backing = "anon"; // See alloc_ram().
+static int    ram_node = -1;        // NUMA node for RAM and vCPUs. If -1, no binding.
+static bool   ram_private;          // RAM pages may be replaced by private file mappings.
 static int    tap_fd;               // TAP device. If 0, network packets go to /dev/null.
 
 static const char *pc_ps2[] = {
@@ -87,7 +98,7 @@ static const char *pc_ps2[] = {
   "ahci:0xe0800000,14",
   "pmtimer:0x8000",
   // 1 vCPU
-  "vcpu", "halifax", "vbios", "lapic",
+  "vcpu", "halifax:64,1", "vbios", "lapic",
   NULL,
   };
 
@@ -96,6 +107,7 @@ static const char *pc_ps2[] = {
 static TimeoutList<32, void> timeouts;
 static timevalue             last_to = ~0ULL;
 static timer_t               timer_id;
+static pthread_mutex_t       timer_mtx = PTHREAD_MUTEX_INITIALIZER;
 
 
 static Clock                 mb_clock(1000000);   // XXX Use correct frequency
@@ -107,6 +119,18 @@ struct Module {
   char       *memory;
   size_t      size;
   const char *cmdline;
+  int         fd;
+
+  // Put the module at a page-aligned address in guest RAM. If the RAM
+  // is private, the file pages are mapped there copy-on-write instead
+  // of copying the whole module.
+  void copy_to(char *dst) const
+  {
+    if (ram_private and !(reinterpret_cast<uintptr_t>(dst) & 0xFFF) and
+        MAP_FAILED != mmap(dst, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, fd, 0))
+      return;
+    memcpy(dst, memory, size);
+  }
 
   static Module from_file(const char *filename, const char *cmdline)
   {
@@ -122,6 +146,7 @@ struct Module {
 
     m.cmdline = cmdline;
     m.size    = info.st_size;
+    m.fd      = fd;
 
     m.memory  = reinterpret_cast<char *>(mmap(NULL, m.size, PROT_READ, MAP_PRIVATE,
                                               fd, 0));
@@ -138,33 +163,11 @@ static std::vector<Module> modules;
 
 // Disk data
 
-struct Disk {
-  const char *name;
-  int         fd;
-  size_t      size;
+static std::vector<Disk *> disks;
 
-  static Disk from_file(const char *filename)
-  {
-    Disk d;
-    struct stat st;
-
-    d.name = filename;
-    if (0  > (d.fd = open(filename, O_RDWR)) or
-        0 != fstat(d.fd, &st)) {
-      perror("open disk"); exit(EXIT_FAILURE);
-    }
-
-    d.size = (st.st_size + 511) & ~511; // Round to sector size
-
-    printf("Added '%s' (%zu bytes) as disk.\n", filename, d.size);
-    return d;
-  }
-};
-
-static std::vector<Disk> disks;
-
-// Used to serialize all operations (for now).
-pthread_mutex_t irq_mtx;
+// Serializes all device models. See attach_device_lock() for the
+// busses it protects.
+RecursiveLock device_lock;
 
 static void skip_instruction(CpuMessage &msg)
 {
@@ -219,34 +222,134 @@ static void handle_vcpu(bool skip, CpuMessage::Type type, VCpu *vcpu, CpuState *
 }
 
 
+// Virtual CPUs
+//
+// Every virtual CPU keeps the timeouts of its CPU-local devices (the
+// LAPIC timer) in its own list and delivers them on its own thread
+// via VCpu::bus_timeout. A running CPU checks the head of the list
+// between instructions, a blocked CPU waits for its timerfd. Thus a
+// LAPIC timer neither wakes up another thread nor takes the device
+// lock.
+
+enum {
+  VCPU_TIMER_SHIFT = 16,   // CPU-local timer numbers are (CPU+1) << VCPU_TIMER_SHIFT | nr.
+};
+
+struct Vcpu_info {
+  VCpu                *vcpu;
+  pthread_t            tid;
+  int                  event_fd;   // Signaled by OP_VCPU_RELEASE.
+  int                  timer_fd;   // Expires with the head of the timeouts.
+  unsigned             timer_base;
+  pthread_mutex_t      timer_mtx;  // Protects the timeouts, next_to and armed_to.
+  TimeoutList<4, void> timeouts;
+  timevalue            next_to;    // Written atomically, as the CPU polls it unlocked.
+  timevalue            armed_to;
+
+  Vcpu_info(VCpu *_vcpu, unsigned nr)
+    : vcpu(_vcpu), tid(), event_fd(-1), timer_fd(-1), timer_base((nr + 1) << VCPU_TIMER_SHIFT),
+      timer_mtx(PTHREAD_MUTEX_INITIALIZER), timeouts(), next_to(~0ULL), armed_to(~0ULL) {}
+};
+
+static std::vector<Vcpu_info *> vcpu_info;
+
+// Program the timerfd with the head of the timeouts. Called with the
+// timer_mtx held.
+static void vcpu_timeout_program(Vcpu_info &info)
+{
+  timevalue next_to = info.next_to;
+  if (next_to == info.armed_to) return;
+  info.armed_to = next_to;
+
+  struct itimerspec t = {};
+  if (next_to != ~0ULL) {
+    unsigned long long delta = mb_clock.delta(next_to, 1000000000UL);
+    // A zero timeout would disarm the timer.
+    if (!delta) delta = 1;
+    t.it_value = { long(delta / 1000000000L), long(delta % 1000000000L) };
+  }
+  int res = timerfd_settime(info.timer_fd, 0, &t, NULL);
+  assert(!res);
+}
+
+// Deliver all CPU-local timeouts that are due. Only called on the
+// thread of the virtual CPU.
+static void vcpu_timeout_trigger(Vcpu_info &info)
+{
+  timevalue now = mb_clock.time();
+
+  while (true) {
+    pthread_mutex_lock(&info.timer_mtx);
+    unsigned nr = info.timeouts.trigger(now);
+    MessageTimeout msg(info.timer_base | nr, info.timeouts.timeout());
+    if (nr) info.timeouts.cancel(nr);
+    __atomic_store_n(&info.next_to, info.timeouts.timeout(), __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&info.timer_mtx);
+
+    if (!nr) break;
+    info.vcpu->bus_timeout.send(msg);
+  }
+}
+
+// Wait for OP_VCPU_RELEASE or the next CPU-local timeout.
+static void vcpu_block(Vcpu_info &info)
+{
+  uint64_t value;
+
+  pthread_mutex_lock(&info.timer_mtx);
+  bool due = info.next_to <= mb_clock.time();
+  if (not due) vcpu_timeout_program(info);
+  pthread_mutex_unlock(&info.timer_mtx);
+
+  if (not due) {
+    struct pollfd fds[2] = { { info.event_fd, POLLIN, 0 }, { info.timer_fd, POLLIN, 0 } };
+    if (0 > poll(fds, 2, -1)) {
+      if (errno != EINTR) perror("poll");
+      return;
+    }
+
+    if (fds[0].revents & POLLIN and 0 > read(info.event_fd, &value, sizeof(value)))
+      perror("read eventfd");
+    if (not (fds[1].revents & POLLIN)) return;
+
+    // The timer might have been reprogrammed meanwhile, which resets
+    // its expiration count.
+    pthread_mutex_lock(&info.timer_mtx);
+    if (0 > read(info.timer_fd, &value, sizeof(value)) and errno != EAGAIN)
+      perror("read timerfd");
+    info.armed_to = ~0ULL;
+    pthread_mutex_unlock(&info.timer_mtx);
+  }
+
+  vcpu_timeout_trigger(info);
+}
+
 static void *vcpu_thread_fn(void *arg)
 {
-  VCpu * vcpu = static_cast<VCpu *>(arg);
+  Vcpu_info &info = *static_cast<Vcpu_info *>(arg);
+  VCpu * vcpu = info.vcpu;
   CpuState cpu_state;
   memset(&cpu_state, 0, sizeof(cpu_state));
 
-  pthread_mutex_lock(&irq_mtx);
+  // Wait until the motherboard is completely set up. From then on,
+  // the CPU runs without any lock and only device accesses are
+  // serialized by the busses.
+  device_lock.lock();
+  device_lock.unlock();
+
   handle_vcpu(false, CpuMessage::TYPE_HLT, vcpu, &cpu_state);
-  pthread_mutex_unlock(&irq_mtx);
 
   while (true) {
-    pthread_mutex_lock(&irq_mtx);
+    if (__atomic_load_n(&info.next_to, __ATOMIC_RELAXED) <= mb_clock.time())
+      vcpu_timeout_trigger(info);
     handle_vcpu(false, CpuMessage::TYPE_SINGLE_STEP, vcpu, &cpu_state);
     // Logging::printf("eip %x\n", cpu_state.eip);
-    pthread_mutex_unlock(&irq_mtx);
   }
 
   // NOTREACHED
   return NULL;
 }
 
-struct  Vcpu_info {
-  pthread_t tid;
-  sem_t     block;
-};
-
-static std::vector<Vcpu_info> vcpu_info;
-
 static bool receive(Device *, MessageHostOp &msg)
 {
     bool res = true;
@@ -268,35 +371,40 @@ static bool receive(Device *, MessageHostOp &msg)
       } else res = false;
       break;
     case MessageHostOp::OP_VCPU_CREATE_BACKEND: {
+      Vcpu_info *info = new Vcpu_info(msg.vcpu, vcpu_info.size());
       msg.value = vcpu_info.size();
+      vcpu_info.push_back(info);
 
-      vcpu_info.push_back(Vcpu_info());
-
-      if ((0 != sem_init(&vcpu_info[msg.value].block, 0, 0)) or
-          (0 != pthread_create(&vcpu_info[msg.value].tid, NULL, vcpu_thread_fn, msg.vcpu))) {
-        perror("sem_init/pthread_create");
+      if ((0 > (info->event_fd = eventfd(0, EFD_NONBLOCK))) or
+          (0 > (info->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK))) or
+          (0 != pthread_create(&info->tid, NULL, vcpu_thread_fn, info))) {
+        perror("eventfd/timerfd_create/pthread_create");
         res = false;
         break;
       }
-      pthread_setname_np(vcpu_info[msg.value].tid, "vcpu");
+      pthread_setname_np(info->tid, "vcpu");
 
       break;
     }
     case MessageHostOp::OP_VCPU_BLOCK:
-      pthread_mutex_unlock(&irq_mtx);
-      sem_wait(&vcpu_info[msg.value].block);
-      pthread_mutex_lock(&irq_mtx);
+      vcpu_block(*vcpu_info[msg.value]);
       break;
-    case MessageHostOp::OP_VCPU_RELEASE:
-      sem_post(&vcpu_info[msg.value].block);
+    case MessageHostOp::OP_VCPU_RELEASE: {
+      // A CPU that wakes itself up, e.g. from its own timeout, is
+      // not blocked.
+      uint64_t value = 1;
+      if (not pthread_equal(pthread_self(), vcpu_info[msg.value]->tid) and
+          0 > write(vcpu_info[msg.value]->event_fd, &value, sizeof(value)))
+        perror("write eventfd");
       break;
+    }
     case MessageHostOp::OP_GET_MODULE:
       // For historical reasons, modules numbers start with 1.
       msg.module --;
 
       if (msg.module < modules.size() and
           msg.size   > modules[msg.module].size) {
-        memcpy(msg.start, modules[msg.module].memory, modules[msg.module].size);
+        modules[msg.module].copy_to(msg.start);
 
         // Align the end of the module to get the cmdline on a new page.
         uintptr_t s = reinterpret_cast<uintptr_t>(msg.start) + modules[msg.module].size;
@@ -324,19 +432,27 @@ static bool receive(Device *, MessageHostOp &msg)
 }
 
 
+// The timer_mtx protects the timeout list and is never held while
+// timeouts are delivered, as devices request new timeouts from
+// their MessageTimeout handlers.
 static void timeout_trigger()
 {
   timevalue now = mb.clock()->time();
 
-  // Force time reprogramming. Otherwise, we might not reprogram a
-  // timer, if the timeout event reached us too early.
-  last_to = ~0ULL;
-
   // trigger all timeouts that are due
-  unsigned nr;
-  while ((nr = timeouts.trigger(now))) {
+  while (true) {
+    pthread_mutex_lock(&timer_mtx);
+
+    // Force time reprogramming. Otherwise, we might not reprogram a
+    // timer, if the timeout event reached us too early.
+    last_to = ~0ULL;
+
+    unsigned nr = timeouts.trigger(now);
     MessageTimeout msg(nr, timeouts.timeout());
-    timeouts.cancel(nr);
+    if (nr) timeouts.cancel(nr);
+    pthread_mutex_unlock(&timer_mtx);
+
+    if (!nr) break;
     mb.bus_timeout.send(msg);
   }
 }
@@ -344,39 +460,49 @@ static void timeout_trigger()
 // Update or program pending timeout.
 static void timeout_request()
 {
-  timevalue next_to = timeouts.timeout();
-  if (next_to != ~0ULL) {
-    unsigned long long delta = mb_clock.delta(next_to, 1000000000UL);
-
-    if (delta == 0) {
-      // Timeout pending NOW. Skip programming a timeout.
-      timeout_trigger();
-
-      // We might have a new timeout pending.
-      timeout_request();
-    } else if (next_to != last_to) {
-      // New timeout. Reprogram timer.
-
-      last_to = next_to;
-
-      // Logging::printf("Programming timer for %lluns.\n", delta);
-
-      struct itimerspec t = {
-        .it_interval = {0, 0},
-        .it_value = {long(delta / 1000000000L), (long)(delta % 1000000000L)}
-      };
-      int res = timer_settime(timer_id, 0, &t, NULL);
-      assert(!res);
+  while (true) {
+    pthread_mutex_lock(&timer_mtx);
+    timevalue next_to = timeouts.timeout();
+    bool      pending = false;
+    if (next_to != ~0ULL) {
+      unsigned long long delta = mb_clock.delta(next_to, 1000000000UL);
+
+      if (delta == 0) {
+        // Timeout pending NOW. Skip programming a timeout.
+        pending = true;
+      } else if (next_to != last_to) {
+        // New timeout. Reprogram timer.
+
+        last_to = next_to;
+
+        // Logging::printf("Programming timer for %lluns.\n", delta);
+
+        struct itimerspec t = {
+          .it_interval = {0, 0},
+          .it_value = {long(delta / 1000000000L), (long)(delta % 1000000000L)}
+        };
+        int res = timer_settime(timer_id, 0, &t, NULL);
+        assert(!res);
+      }
     }
+    pthread_mutex_unlock(&timer_mtx);
+    if (!pending) return;
+
+    // We might have a new timeout pending afterwards.
+    timeout_trigger();
   }
 }
 
 static void timeout_handler_fn(union sigval)
 {
-  pthread_mutex_lock(&irq_mtx);
   timeout_trigger();
   timeout_request();
-  pthread_mutex_unlock(&irq_mtx);
+}
+
+static Vcpu_info *vcpu_timer_owner(unsigned nr)
+{
+  unsigned cpu = nr >> VCPU_TIMER_SHIFT;
+  return (cpu and cpu <= vcpu_info.size()) ? vcpu_info[cpu - 1] : nullptr;
 }
 
 static bool receive(Device *, MessageTimer &msg)
@@ -384,10 +510,32 @@ static bool receive(Device *, MessageTimer &msg)
   switch (msg.type)
     {
     case MessageTimer::TIMER_NEW:
+      for (Vcpu_info *info : vcpu_info)
+        if (info->vcpu == msg.vcpu) {
+          pthread_mutex_lock(&info->timer_mtx);
+          msg.nr = info->timer_base | info->timeouts.alloc();
+          pthread_mutex_unlock(&info->timer_mtx);
+          return true;
+        }
+
+      pthread_mutex_lock(&timer_mtx);
       msg.nr = timeouts.alloc();
+      pthread_mutex_unlock(&timer_mtx);
       return true;
     case MessageTimer::TIMER_REQUEST_TIMEOUT:
+      if (Vcpu_info *info = vcpu_timer_owner(msg.nr)) {
+        pthread_mutex_lock(&info->timer_mtx);
+        info->timeouts.request(msg.nr & ((1U << VCPU_TIMER_SHIFT) - 1), msg.abstime);
+        __atomic_store_n(&info->next_to, info->timeouts.timeout(), __ATOMIC_RELAXED);
+        // The CPU itself checks its timeouts before it blocks.
+        if (not pthread_equal(pthread_self(), info->tid)) vcpu_timeout_program(*info);
+        pthread_mutex_unlock(&info->timer_mtx);
+        break;
+      }
+
+      pthread_mutex_lock(&timer_mtx);
       timeouts.request(msg.nr, msg.abstime);
+      pthread_mutex_unlock(&timer_mtx);
       timeout_request();
       break;
     default:
@@ -408,46 +556,201 @@ static bool receive(Device *, MessageTime &msg)
 }
 
 // Network support
+//
+// A single I/O thread waits with epoll for frames from the TAP device
+// and for frames that the device models queued for transmission. It
+// reads all pending frames before it delivers them with a single
+// acquisition of the device lock. Virtual CPUs never block on the
+// TAP device.
+
+//#define NET_DEBUG
+#ifdef NET_DEBUG
+#  define NET_LOG(fmt, ...) Logging::printf(fmt, ## __VA_ARGS__)
+#else
+#  define NET_LOG(fmt, ...)
+#endif
+
+enum {
+  NETWORK_FRAME = 2048,      // Size of the receive buffers.
+  NETWORK_RX_BATCH = 32,     // Frames read before they are delivered.
+  NETWORK_TX_QUEUE = 256,    // Frames that may wait for transmission.
+  NETWORK_TX_FRAGS = 64,     // Fragments that are written without a copy.
+};
+
+struct NetworkFrame {
+  unsigned char *data;
+  size_t         len;
+  size_t         size;
+};
 
-static unsigned char network_pbuf[2048];
+static unsigned char   network_rx[NETWORK_RX_BATCH][NETWORK_FRAME];
+static NetworkFrame    network_tx[NETWORK_TX_QUEUE];
+static unsigned        network_tx_head;   // Next free slot.
+static unsigned        network_tx_tail;   // Oldest queued frame.
+static unsigned long   network_tx_dropped;
+static pthread_mutex_t network_tx_mtx = PTHREAD_MUTEX_INITIALIZER;
+static int             network_event_fd;  // Signals queued frames.
+static volatile bool   network_exit;
+
+static void network_transmit()
+{
+  while (true) {
+    pthread_mutex_lock(&network_tx_mtx);
+    bool empty = network_tx_head == network_tx_tail;
+    pthread_mutex_unlock(&network_tx_mtx);
+    if (empty) break;
+
+    // The slot stays owned by us until we advance the tail.
+    NetworkFrame &f = network_tx[network_tx_tail];
+    ssize_t res = write(tap_fd, f.data, f.len);
+    if (res != ssize_t(f.len)) perror("write to tap");
+    NET_LOG("tap: wrote %zu bytes.\n", f.len);
+
+    pthread_mutex_lock(&network_tx_mtx);
+    network_tx_tail = (network_tx_tail + 1) % NETWORK_TX_QUEUE;
+    pthread_mutex_unlock(&network_tx_mtx);
+  }
+}
+
+static bool network_receive()
+{
+  size_t   len[NETWORK_RX_BATCH];
+  unsigned count;
+  bool     res = true;
+
+  for (count = 0; count < NETWORK_RX_BATCH; count++) {
+    ssize_t bytes = read(tap_fd, network_rx[count], NETWORK_FRAME);
+    if (bytes < 0 and (errno == EAGAIN or errno == EINTR)) break;
+    if (bytes <= 0) { res = false; break; }
+    len[count] = bytes;
+    NET_LOG("tap: read %zd bytes.\n", bytes);
+  }
+
+  if (count) {
+    device_lock.lock();
+    for (unsigned i = 0; i < count; i++) {
+      MessageNetwork msg(network_rx[i], len[i], 0);
+      mb.bus_network.send(msg);
+    }
+    device_lock.unlock();
+  }
+  return res;
+}
 
 static void *network_io_thread_fn(void *)
 {
-  fd_set set;
-  FD_ZERO(&set);
-  FD_SET(tap_fd, &set);
+  int epfd = epoll_create1(0);
+  struct epoll_event ev;
+
+  ev.events   = EPOLLIN;
+  ev.data.fd  = tap_fd;
+  if (0 > epfd or 0 != epoll_ctl(epfd, EPOLL_CTL_ADD, tap_fd, &ev)) {
+    perror("epoll");
+    return nullptr;
+  }
+  ev.data.fd  = network_event_fd;
+  if (0 != epoll_ctl(epfd, EPOLL_CTL_ADD, network_event_fd, &ev)) {
+    perror("epoll");
+    return nullptr;
+  }
 
-  while (true) {
-    fd_set rset = set;
-    if (0 > select(tap_fd + 1, &rset, nullptr, nullptr, nullptr)) {
-      perror("select");
+  while (not network_exit) {
+    struct epoll_event events[2];
+    int n = epoll_wait(epfd, events, 2, -1);
+    if (n < 0 and errno != EINTR) {
+      perror("epoll_wait");
       break;
     }
 
-    int  res = read(tap_fd, network_pbuf, sizeof(network_pbuf));
-    if (res <= 0) break;
-    printf("tap: read %u bytes.\n", res);
-    MessageNetwork msg(network_pbuf, res, 0);
-
-    pthread_mutex_lock(&irq_mtx);
-    mb.bus_network.send(msg);
-    pthread_mutex_unlock(&irq_mtx);
+    for (int i = 0; i < n; i++)
+      if (events[i].data.fd == tap_fd) {
+        if (not network_receive()) network_exit = true;
+      } else {
+        uint64_t value;
+        if (0 > read(network_event_fd, &value, sizeof(value))) perror("read eventfd");
+        network_transmit();
+      }
   }
 
+  close(epfd);
   return nullptr;
 }
 
-static bool receive(Device *, MessageNetwork &msg)
+// Send packets to the TAP device. If nothing is queued, we try to
+// write them without copying, because fragments typically point
+// into guest memory. The rest, e.g. of a TSO burst that hits EAGAIN,
+// is queued for the I/O thread. The device lock serializes the
+// producers, thus nobody else fills the queue meanwhile. The I/O
+// thread may still drain it, thus the wakeup is decided while we
+// append.
+static void network_send(const MessageNetwork::Packet *packets, unsigned count)
 {
-  int res;
+  pthread_mutex_lock(&network_tx_mtx);
+  bool empty = network_tx_head == network_tx_tail;
+  pthread_mutex_unlock(&network_tx_mtx);
+
+  unsigned i = 0;
+  for (; empty and i < count; i++) {
+    const MessageNetwork::Packet &p = packets[i];
+    if (p.fragcount > NETWORK_TX_FRAGS) break;
+
+    struct iovec iov[NETWORK_TX_FRAGS];
+    for (unsigned j = 0; j < p.fragcount; j++)
+      iov[j] = { const_cast<unsigned char *>(p.fragments[j].buffer), p.fragments[j].len };
+    ssize_t res = writev(tap_fd, iov, p.fragcount);
+    if (res < 0 and errno == EAGAIN) break;
+    if (res != ssize_t(p.len)) perror("write to tap");
+  }
+  if (i == count) return;
+
+  pthread_mutex_lock(&network_tx_mtx);
+  bool     wakeup = network_tx_head == network_tx_tail;
+  unsigned first  = i;
+  for (; i < count; i++) {
+    unsigned next = (network_tx_head + 1) % NETWORK_TX_QUEUE;
+    if (next == network_tx_tail) {
+      network_tx_dropped += count - i;
+      break;
+    }
+
+    const MessageNetwork::Packet &p = packets[i];
+    NetworkFrame &f = network_tx[network_tx_head];
+    if (f.size < p.len) {
+      f.data = reinterpret_cast<unsigned char *>(realloc(f.data, p.len));
+      f.size = p.len;
+    }
+    f.len = MessageNetwork(p.fragments, p.fragcount, p.len, 0).copy(f.data, p.len);
+    network_tx_head = next;
+  }
+  pthread_mutex_unlock(&network_tx_mtx);
+
+  // The I/O thread drains the whole queue, thus only wake it up
+  // if it was empty.
+  uint64_t value = 1;
+  if (wakeup and i != first and 0 > write(network_event_fd, &value, sizeof(value)))
+    perror("write eventfd");
+}
 
+static bool receive(Device *, MessageNetwork &msg)
+{
   switch (msg.type) {
   case MessageNetwork::PACKET:
-    Logging::printf("packet %zu bytes\n", msg.len);
-    if (tap_fd and msg.buffer != network_pbuf) {
-      res = write(tap_fd, msg.buffer, msg.len);
-      if (res != static_cast<int>(msg.len)) perror("write to tap");
+    {
+      NET_LOG("packet %zu bytes\n", msg.len);
+
+      // Do not send our own frames back.
+      if (not tap_fd or (msg.buffer >= network_rx[0] and msg.buffer < network_rx[NETWORK_RX_BATCH]))
+        return true;
+
+      MessageNetwork::Fragment frag = { msg.buffer, msg.len };
+      MessageNetwork::Packet packet = { msg.buffer ? &frag : msg.fragments,
+                                        msg.buffer ? 1 : msg.fragcount, msg.len };
+      network_send(&packet, 1);
+      return true;
     }
+  case MessageNetwork::PACKETS:
+    NET_LOG("%u packets\n", msg.packetcount);
+    if (tap_fd) network_send(msg.packets, msg.packetcount);
     return true;
   case MessageNetwork::QUERY_MAC:
   default:
@@ -456,45 +759,100 @@ static bool receive(Device *, MessageNetwork &msg)
 
 }
 
-static bool receive(Device *, MessageDisk &msg)
+// Asynchronous disk I/O
+//
+// Reads, writes and cache flushes are queued by the virtual CPUs and
+// executed by a pool of worker threads, which commit them to the
+// device models. Thus a disk request does not stall the VM and the
+// AHCI model can have several NCQ commands in flight.
+
+struct DiskRequest {
+  MessageDisk                msg;
+  std::vector<DmaDescriptor> dma;
+
+  DiskRequest(MessageDisk &m) : msg(m), dma(m.dma, m.dma + m.dmacount)
+  {
+    msg.dma = dma.data();
+  }
+};
+
+static unsigned                  disk_queue_depth = 8;        // Number of disk workers.
+static size_t                    disk_cache_size  = 16 << 20; // Block cache per disk.
+static std::deque<DiskRequest *> disk_queue;
+static pthread_mutex_t           disk_mtx  = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t            disk_cond = PTHREAD_COND_INITIALIZER;
+
+static MessageDisk::Status disk_rw(Disk &disk, MessageDisk &msg)
 {
-  if (msg.disknr >= disks.size()) return false;
+  unsigned long long offset = msg.sector << 9;
+  size_t             length = DmaDescriptor::sum_length(msg.dmacount, msg.dma);
 
-  Disk               &disk   = disks[msg.disknr];
-  MessageDisk::Status status = MessageDisk::DISK_OK;
-  unsigned long long  offset = msg.sector << 9;
+  if (offset + length > disk.size)
+    return MessageDisk::DISK_STATUS_DEVICE;
 
-  switch (msg.type) {
-  case MessageDisk::DISK_READ:
-  case MessageDisk::DISK_WRITE:
-    for (unsigned i=0; i < msg.dmacount; i++) {
-      size_t  start = offset;
-      size_t  end   = start + msg.dma[i].bytecount;
-      ssize_t bytes;
-
-      if (end > disk.size or start > disk.size or
-          msg.dma[i].byteoffset > msg.physsize or
-          msg.dma[i].byteoffset + msg.dma[i].bytecount > msg.physsize) {
-        status = MessageDisk::Status(MessageDisk::DISK_STATUS_DEVICE |
-                                     (i << MessageDisk::DISK_STATUS_SHIFT));
-        break;
-      }
+  // Transfer directly from and to guest RAM with a single syscall.
+  std::vector<struct iovec> iov;
+  size_t mapped = DmaDescriptor::map(mb.bus_memregion, msg.dmacount, msg.dma,
+                                     [&iov](char *ptr, size_t len) { iov.push_back({ ptr, len }); });
+  if (mapped != msg.dmacount)
+    return MessageDisk::Status(MessageDisk::DISK_STATUS_DMA |
+                               (mapped << MessageDisk::DISK_STATUS_SHIFT));
+
+  if (!disk.rw(msg.type == MessageDisk::DISK_READ, iov, offset, length))
+    Logging::printf("short read/write on %s\n", disk.name);
 
-      // XXX Workaround, use hostop GUEST_MEM.
-      msg.physoffset = reinterpret_cast<uintptr_t>(ram);
+  if (msg.type == MessageDisk::DISK_READ)
+    DmaDescriptor::written(mb.bus_memregion, msg.dmacount, msg.dma);
 
-      typedef int (*RWFn)(int,void *,size_t,off_t);
-      bytes = ((msg.type == MessageDisk::DISK_READ) ? (RWFn)pread : (RWFn)pwrite)
-        (disk.fd, reinterpret_cast<void *>(msg.dma[i].byteoffset + msg.physoffset),
-         end - start, start);
+  return MessageDisk::DISK_OK;
+}
 
-      if (bytes < ssize_t(end - start)) {
-        Logging::printf("short read/write: %zd instead of %zd\n", bytes, end - start);
+static void *disk_thread_fn(void *)
+{
+  while (true) {
+    pthread_mutex_lock(&disk_mtx);
+    while (disk_queue.empty())
+      pthread_cond_wait(&disk_cond, &disk_mtx);
+    DiskRequest *req = disk_queue.front();
+    disk_queue.pop_front();
+    pthread_mutex_unlock(&disk_mtx);
+
+    MessageDisk        &msg    = req->msg;
+    Disk               &disk   = *disks[msg.disknr];
+    MessageDisk::Status status = MessageDisk::DISK_OK;
+
+    if (msg.type == MessageDisk::DISK_FLUSH_CACHE) {
+      if (!disk.flush()) {
+        perror("flush disk");
+        status = MessageDisk::DISK_STATUS_DEVICE;
       }
+    } else
+      status = disk_rw(disk, msg);
 
-      offset += end - start;
-    }
-    break;
+    MessageDiskCommit cmsg(msg.disknr, msg.usertag, status);
+    mb.bus_diskcommit.send(cmsg);
+    delete req;
+  }
+
+  // NOTREACHED
+  return NULL;
+}
+
+static bool receive(Device *, MessageDisk &msg)
+{
+  if (msg.disknr >= disks.size()) return false;
+
+  Disk &disk = *disks[msg.disknr];
+
+  switch (msg.type) {
+  case MessageDisk::DISK_READ:
+  case MessageDisk::DISK_WRITE:
+  case MessageDisk::DISK_FLUSH_CACHE:
+    pthread_mutex_lock(&disk_mtx);
+    disk_queue.push_back(new DiskRequest(msg));
+    pthread_cond_signal(&disk_cond);
+    pthread_mutex_unlock(&disk_mtx);
+    return true;
   case MessageDisk::DISK_GET_PARAMS:
     {
       msg.params->flags = DiskParameter::FLAG_HARDDISK;
@@ -504,21 +862,165 @@ static bool receive(Device *, MessageDisk &msg)
       strncpy(msg.params->name, disk.name, sizeof(msg.params->name));
       return true;
     }
-  case MessageDisk::DISK_FLUSH_CACHE:
-    break;
   default:
     assert(0);
   }
+  return false;
+}
+
+/**
+ * Serialize the device models with the device lock. The remaining
+ * busses are either CPU-local, are handled by this frontend with its
+ * own locking or are only used during startup:
+ *  - bus_apic: the LAPICs accept IPIs with atomic operations,
+ *  - VCpu::bus_timeout: CPU-local timeouts are delivered on the CPU's thread,
+ *  - bus_memregion: the memory map does not change at runtime,
+ *  - bus_hostop, bus_timer, bus_time, bus_disk: see above.
+ *
+ * The disk workers commit requests via bus_diskcommit and thus take
+ * the device lock as well.
+ *
+ * The LAPICs run unlocked on their vCPU threads.  Other threads reach
+ * them only through these entry points, which post the work to the
+ * owning vCPU:
+ *  - bus_legacy INTR/DEASS_INTR/NMI: LINT0 and LINT1 from the devices,
+ *  - bus_timeout: timeouts of the global timer,
+ *  - bus_apic and the APIC directory: fixed IPIs, MSIs and deasserts go
+ *    to the PIR, errors are posted as events,
+ *  - INIT, SIPI, SMI, NMI and EXTINT IPIs are forwarded as CpuEvent.
+ */
+static void attach_device_lock()
+{
+  mb.bus_acpi          .set_lock(&device_lock);
+  mb.bus_ahcicontroller.set_lock(&device_lock);
+  mb.bus_bios          .set_lock(&device_lock);
+  mb.bus_console       .set_lock(&device_lock);
+  mb.bus_discovery     .set_lock(&device_lock);
+  mb.bus_diskcommit    .set_lock(&device_lock);
+  mb.bus_hwioin        .set_lock(&device_lock);
+  mb.bus_ioin          .set_lock(&device_lock);
+  mb.bus_hwioout       .set_lock(&device_lock);
+  mb.bus_ioout         .set_lock(&device_lock);
+  mb.bus_input         .set_lock(&device_lock);
+  mb.bus_hostirq       .set_lock(&device_lock);
+  mb.bus_irqlines      .set_lock(&device_lock);
+  mb.bus_irqnotify     .set_lock(&device_lock);
+  mb.bus_legacy        .set_lock(&device_lock);
+  mb.bus_mem           .set_lock(&device_lock);
+  mb.bus_network       .set_lock(&device_lock);
+  mb.bus_ps2           .set_lock(&device_lock);
+  mb.bus_hwpcicfg      .set_lock(&device_lock);
+  mb.bus_pcicfg        .set_lock(&device_lock);
+  mb.bus_pic           .set_lock(&device_lock);
+  mb.bus_pit           .set_lock(&device_lock);
+  mb.bus_serial        .set_lock(&device_lock);
+  mb.bus_timeout       .set_lock(&device_lock);
+  mb.bus_vesa          .set_lock(&device_lock);
+}
+
+// Guest memory
+//
+// Guest RAM is anonymous memory by default. It can be backed by
+// transparent or hugetlbfs huge pages to reduce host TLB misses, or
+// by a memfd that other processes can map via /proc/PID/fd. With a
+// NUMA node given, RAM is bound to that node and all threads run on
+// its CPUs.
+
+enum {
+  HUGE_PAGE_SIZE = 2 << 20,
+};
+
+static char *alloc_ram(size_t size)
+{
+  bool   memfd   = !strncmp(ram_backing, "memfd", 5);
+  bool   hugetlb = !strcmp(ram_backing, "hugetlb") or !strcmp(ram_backing, "memfd-hugetlb");
+  bool   thp     = !strcmp(ram_backing, "thp");
+  int    flags   = MAP_PRIVATE | MAP_ANON;
+  int    fd      = -1;
+
+  if (!memfd and !hugetlb and !thp and strcmp(ram_backing, "anon")) {
+    fprintf(stderr, "Unknown RAM backing '%s'.\n", ram_backing);
+    return nullptr;
+  }
+
+  // Huge pages need a multiple of their size.
+  if (hugetlb or thp) size = (size + HUGE_PAGE_SIZE - 1) & ~size_t(HUGE_PAGE_SIZE - 1);
+
+  if (memfd) {
+    fd = memfd_create("seoul-ram", hugetlb ? MFD_HUGETLB : 0);
+    if (0 > fd or 0 != ftruncate(fd, size)) {
+      perror("memfd_create/ftruncate");
+      return nullptr;
+    }
+    flags = MAP_SHARED;
+  } else if (hugetlb)
+    flags |= MAP_HUGETLB;
+
+  char *mem = reinterpret_cast<char *>(mmap(nullptr, size, PROT_READ | PROT_WRITE, flags, fd, 0));
+  if (mem == MAP_FAILED) {
+    perror("mmap");
+    return nullptr;
+  }
 
-  MessageDiskCommit cmsg(msg.disknr, msg.usertag, status);
-  mb.bus_diskcommit.send(cmsg);
+  if (thp and 0 != madvise(mem, size, MADV_HUGEPAGE))
+    perror("madvise");
+
+  // Shared and hugetlb pages cannot be replaced by multiboot modules.
+  ram_private = !memfd and !hugetlb;
+
+  // The pages are not populated yet, thus they are allocated on the node.
+  if (ram_node >= 0) {
+    unsigned long nodemask = 1UL << ram_node;
+    if (0 != syscall(SYS_mbind, mem, size, MPOL_BIND, &nodemask, sizeof(nodemask) * 8, 0))
+      perror("mbind");
+  }
+
+  if (memfd)
+    printf("Guest RAM is /proc/%u/fd/%d.\n", getpid(), fd);
+  return mem;
+}
+
+// Run this thread and all threads it creates on the CPUs of a NUMA
+// node.
+static bool bind_to_node(int node)
+{
+  char path[64];
+  snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+  FILE *f = fopen(path, "r");
+  if (!f) {
+    perror(path);
+    return false;
+  }
+
+  // The list looks like "0-3,8-11".
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  unsigned first, last;
+  while (fscanf(f, "%u", &first) == 1) {
+    last = first;
+    int c = fgetc(f);
+    if (c == '-') {
+      if (fscanf(f, "%u", &last) != 1) break;
+      c = fgetc(f);
+    }
+    for (unsigned cpu = first; cpu <= last and cpu < CPU_SETSIZE; cpu++)
+      CPU_SET(cpu, &set);
+    if (c != ',') break;
+  }
+  fclose(f);
 
+  if (!CPU_COUNT(&set) or 0 != sched_setaffinity(0, sizeof(set), &set)) {
+    fprintf(stderr, "Cannot run on the CPUs of node %d.\n", node);
+    return false;
+  }
   return true;
 }
 
 static void usage()
 {
-  fprintf(stderr, "Usage: seoul [-m RAM] [-n tap-device] [-d disk-image]\n"
+  fprintf(stderr, "Usage: seoul [-m RAM] [-n tap-device] [-d disk-image[,overlay]]\n"
+                  "             [-c disk-cache-MB] [-q disk-queue-depth]\n"
+                  "             [-r anon|thp|hugetlb|memfd|memfd-hugetlb] [-N numa-node]\n"
                   "             [kernel parameters] [module1 parameters] ...\n");
   exit(EXIT_FAILURE);
 }
@@ -534,8 +1036,9 @@ int main(int argc, char **argv)
     usage();
   }
 
+  std::vector<char *> disk_args;
   int ch;
-  while ((ch = getopt(argc, argv, "hm:n:d:")) != -1) {
+  while ((ch = getopt(argc, argv, "hm:n:d:c:q:r:N:")) != -1) {
     switch (ch) {
     case 'm':
       ram_size = atoi(optarg) << 20;
@@ -548,7 +1051,21 @@ int main(int argc, char **argv)
       }
       break;
     case 'd':
-      disks.push_back(Disk::from_file(optarg));
+      disk_args.push_back(optarg);
+      break;
+    case 'c':
+      disk_cache_size = size_t(atoi(optarg)) << 20;
+      break;
+    case 'q':
+      disk_queue_depth = atoi(optarg);
+      if (!disk_queue_depth) usage();
+      break;
+    case 'r':
+      ram_backing = optarg;
+      break;
+    case 'N':
+      ram_node = atoi(optarg);
+      if (ram_node < 0 or ram_node >= int(sizeof(unsigned long) * 8)) usage();
       break;
     case 'h':
     case '?':
@@ -567,14 +1084,22 @@ int main(int argc, char **argv)
     modules.push_back(Module::from_file(argv[i], argv[i+1]));
   }
 
-  // Allocating RAM.
+  // image[,overlay]
+  for (char *arg : disk_args) {
+    char *overlay = strchr(arg, ',');
+    if (overlay) *overlay++ = 0;
+    disks.push_back(Disk::from_file(arg, overlay, disk_cache_size));
+  }
 
-  ram = reinterpret_cast<char *>(mmap(nullptr, ram_size, PROT_READ | PROT_WRITE,
-                                        MAP_PRIVATE | MAP_ANON, -1, 0));
-  if (ram == MAP_FAILED) {
-    perror("mmap");
+  // Allocating RAM. The threads are created later and inherit the
+  // affinity.
+
+  if (ram_node >= 0 and !bind_to_node(ram_node))
+    return EXIT_FAILURE;
+
+  ram = alloc_ram(ram_size);
+  if (!ram)
     return EXIT_FAILURE;
-  }
 
   // Creating timer. I hate C++: No useful initializers...
   struct sigevent ev;
@@ -595,12 +1120,10 @@ int main(int argc, char **argv)
   mb.bus_network.add(nullptr, receive);
   mb.bus_disk   .add(nullptr, receive);
 
-  // Synchronization initialization
-  if (0 != pthread_mutex_init(&irq_mtx, nullptr)) {
-    perror("pthread_mutex_init");
-    return EXIT_FAILURE;
-  }
-  pthread_mutex_lock(&irq_mtx);
+  // Synchronization initialization. The virtual CPUs wait for the
+  // device lock until the motherboard is set up.
+  attach_device_lock();
+  device_lock.lock();
 
   // Create standard PC
   for (const char **dev = pc_ps2; *dev != NULL; dev++) {
@@ -638,6 +1161,11 @@ int main(int argc, char **argv)
   pthread_t iothread;
   if (tap_fd) {
     Logging::printf("Starting background threads.\n");
+    network_event_fd = eventfd(0, 0);
+    if (0 > network_event_fd or 0 != fcntl(tap_fd, F_SETFL, O_NONBLOCK)) {
+      perror("eventfd/fcntl");
+      return EXIT_FAILURE;
+    }
     if (0 != pthread_create(&iothread, NULL, network_io_thread_fn, NULL)) {
       perror("pthread_create");
       return EXIT_FAILURE;
@@ -645,20 +1173,38 @@ int main(int argc, char **argv)
     pthread_setname_np(iothread, "io");
   }
 
+  for (unsigned i = 0; disks.size() and i < disk_queue_depth; i++) {
+    pthread_t diskthread;
+    if (0 != pthread_create(&diskthread, NULL, disk_thread_fn, NULL)) {
+      perror("pthread_create");
+      return EXIT_FAILURE;
+    }
+    pthread_setname_np(diskthread, "disk");
+  }
+
   Logging::printf("Virtual CPUs starting.\n");
-  pthread_mutex_unlock(&irq_mtx);
+  device_lock.unlock();
 
   // Waiting for CPUs to exit.
-  for (Vcpu_info &i : vcpu_info)
-    if (0 != pthread_join(i.tid, nullptr))
+  for (Vcpu_info *i : vcpu_info)
+    if (0 != pthread_join(i->tid, nullptr))
       perror("pthread_join");
 
   // Force IO thread to exit.
   if (tap_fd) {
-    close(tap_fd);
+    uint64_t value = 1;
+    network_exit = true;
+    if (0 > write(network_event_fd, &value, sizeof(value))) perror("write eventfd");
     pthread_join(iothread, nullptr);
+    close(tap_fd);
+    if (network_tx_dropped)
+      printf("tap: dropped %lu frames.\n", network_tx_dropped);
   }
 
+  for (Disk *d : disks)
+    printf("%s: cache %lu hits, %lu misses, %lu chunks read ahead\n",
+           d->name, d->hits, d->misses, d->readaheads);
+
   printf("Terminating.\n");
   return EXIT_SUCCESS;
 }
@@ -25,8 +25,6 @@
 #include <unistd.h>
 #include <sys/time.h>
 
-#include <seoul/unix.h>
-
 class NcursesDisplay : public StaticReceiver<NcursesDisplay> {
   struct View {
     const char *name;
@@ -122,18 +120,14 @@ class NcursesDisplay : public StaticReceiver<NcursesDisplay> {
         goto done;
       case KEY_HOME: {
         MessageConsole msg(MessageConsole::TYPE_RESET);
-        pthread_mutex_lock(&irq_mtx);
         mb.bus_console.send(msg);
-        pthread_mutex_unlock(&irq_mtx);
       }
         break;
 
       case KEY_F(12): {
-        pthread_mutex_lock(&irq_mtx);
         CpuEvent msg(VCpu::EVENT_DEBUG);
         for (VCpu *vcpu = mb.last_vcpu; vcpu; vcpu=vcpu->get_last())
           vcpu->bus_event.send(msg);
-        pthread_mutex_unlock(&irq_mtx);
       }
         break;
 